@@ -3,6 +3,11 @@
 #include<sys/types.h>
 #include<stdint.h>
 #include<inttypes.h>
+#include<string.h>
+#ifndef PLATFORM_WINDOWS
+  #include<signal.h>
+  #include<sys/time.h>
+#endif
 
 //============================================================
 //=================== OPCODES ================================
@@ -12,6 +17,7 @@
 #define SET_OPCODE_UNSIGNED 1
 #define SET_OPCODE_SIGNED 2
 #define SET_OPCODE_CODE 3
+#define SET_OPCODE_SHORT 4
 #define SET_OPCODE_GLOBAL 5
 #define SET_OPCODE_DATA 6
 #define SET_OPCODE_CONST 7
@@ -20,6 +26,7 @@
 #define SET_REG_OPCODE_UNSIGNED 10
 #define SET_REG_OPCODE_SIGNED 11
 #define SET_REG_OPCODE_CODE 12
+#define SET_REG_OPCODE_SHORT 13
 #define SET_REG_OPCODE_GLOBAL 14
 #define SET_REG_OPCODE_DATA 15
 #define SET_REG_OPCODE_CONST 16
@@ -33,6 +40,8 @@
 #define TCALL_CLOSURE_OPCODE 26
 #define CALLC_OPCODE_LOCAL 27
 #define CALLC_OPCODE_WIDE 28
+#define CALLC_DIRECT_OPCODE_LOCAL 29
+#define CALLC_DIRECT_OPCODE_WIDE 25
 #define POP_FRAME_OPCODE 30
 #define LIVE_OPCODE 31
 #define YIELD_OPCODE 32
@@ -242,6 +251,7 @@
 #define DISPATCH_METHOD_OPCODE 237
 #define JUMP_REG_OPCODE 238
 #define FNENTRY_OPCODE 239
+#define LAZY_ENTRY_OPCODE 247
 
 //============================================================
 //===================== READ MACROS ==========================
@@ -270,6 +280,11 @@
   int value = W1 >> 18; \
   /*if(iprint) printf("          %ld) [%d | %d | %d]\n", icounter, opcode, x, value);*/
 
+#define DECODE_B_SIGNED() \
+  int x = (W1 >> 8) & 0x3FF; \
+  int value = (int)W1 >> 18; \
+  /*if(iprint) printf("          %ld) [%d | %d | %d]\n", icounter, opcode, x, value);*/
+
 #define DECODE_C() \
   int x = (W1 >> 8) & 0x3FF; \
   int y = (W1 >> 22) & 0x3FF; \
@@ -303,11 +318,11 @@
 #define F_JUMP(condition) \
   if(condition){ \
     pc = pc0 + (n1 * 4); \
-    continue; \
+    NEXT; \
   } \
   else{ \
     pc = pc0 + (n2 * 4); \
-    continue; \
+    NEXT; \
   }
 
 #define DECODE_TGTS() \
@@ -317,6 +332,100 @@
     /*printf("            tgt: %d\n", tgt);*/ \
   }
 
+//============================================================
+//=================== DISPATCH MACROS ========================
+//============================================================
+
+//When VM_THREADED_DISPATCH is defined (and the compiler supports
+//labels as values), each handler jumps directly to the handler of
+//the next instruction through a table of label addresses, instead
+//of returning to the top of the loop and going through the switch.
+//This gives the branch predictor one indirect jump per handler.
+//Otherwise, we fall back to the portable switch-based loop.
+
+#if defined(VM_THREADED_DISPATCH) && defined(__GNUC__)
+  #define USE_THREADED_DISPATCH
+#endif
+
+//When VM_PROFILE_OPCODE_PAIRS is defined, the VM counts how often
+//each opcode is immediately followed by each other opcode, and
+//prints the most frequent pairs on exit. This is used for choosing
+//which pairs to fuse into superinstructions.
+#ifdef VM_PROFILE_OPCODE_PAIRS
+  #define PROFILE_OPCODE_PAIR() \
+    if(prev_opcode >= 0) opcode_pair_counts[prev_opcode][opcode]++; \
+    prev_opcode = opcode;
+#else
+  #define PROFILE_OPCODE_PAIR()
+#endif
+
+//When a VMProfile is installed in the VMState, the VM counts the
+//number of times each function is called. When VM_PROFILE_OPCODES is
+//also defined, it counts the number of times each opcode is executed.
+//This is kept out of the default build because it costs a check on
+//every instruction. See VM PROFILING below.
+#ifdef VM_PROFILE_OPCODES
+  #define PROFILE_OPCODE() \
+    if(profile != NULL) profile_opcode(profile, opcode);
+#else
+  #define PROFILE_OPCODE()
+#endif
+
+//When VM_TRACE is defined and a VMTrace is installed in the VMState,
+//the VM records the pc, opcode, and time of each executed instruction.
+#ifdef VM_TRACE
+  #define TRACE_INS() \
+    if(trace != NULL) trace_ins(trace, (uint32_t)(pc0 - instructions), opcode);
+#else
+  #define TRACE_INS()
+#endif
+
+//When a VMAllocSampler is installed in the VMState, the VM records
+//the pc and type of the allocation that crosses each multiple of the
+//sampling interval.
+#define SAMPLE_ALLOC(type, num_bytes) \
+  if(alloc_sampler != NULL) \
+    sample_alloc(alloc_sampler, (uint32_t)(pc0 - instructions), type, num_bytes);
+
+#define PROFILE_CALL(fid) \
+  if(profile != NULL && (uint64_t)(fid) < profile->num_functions) \
+    profile->function_counts[fid]++;
+
+//When the sampling profiler has requested a sample, the VM records
+//the current pc and call stack. This is checked at calls and
+//unconditional jumps, after pc has been updated. See SAMPLING
+//PROFILER below.
+#define CHECK_SAMPLE() \
+  if(__builtin_expect(vm_sample_pending, 0)){ \
+    vm_sample_pending = 0; \
+    SAVE_STATE(); \
+    call_record_sample(vms, (uint64_t)(pc - instructions)); \
+  }
+
+//FETCH reads the opcode of the next instruction, and saves the
+//pre-decode PC because jump offsets are relative to it.
+#define FETCH() \
+  pc0 = pc; \
+  W1 = PC_INT(); \
+  opcode = W1 & 0xFF; \
+  PROFILE_OPCODE_PAIR(); \
+  PROFILE_OPCODE(); \
+  TRACE_INS();
+
+#ifdef USE_THREADED_DISPATCH
+  #define CASE(op) case op : op_##op
+
+  #define NEXT \
+    do{ \
+      FETCH(); \
+      goto *dispatch_table[opcode]; \
+    }while(0)
+#else
+  #define CASE(op) case op
+
+  #define NEXT continue
+#endif
+
 #define SET_REG(r,v) \
   registers[r] = v    
 #define SET_LOCAL(l,v) \
@@ -356,6 +465,12 @@
   stack_pointer = stk->stack_pointer; \
   stack_limit = (char*)(stk->frames) + stk->size;
 
+//Loading code may move the instructions, so these must be
+//reloaded after anything that may have run more bytecode.
+#define RELOAD_CODE() \
+  instructions = vms->instructions; \
+  code_offsets = vms->code_offsets;
+
 #define INT_TAG_BITS 0
 #define REF_TAG_BITS 1
 #define MARKER_TAG_BITS 2
@@ -387,6 +502,73 @@
 //==================== Machine Types =========================
 //============================================================
 
+//An inline cache entry for a dispatch instruction. Records the
+//argument indices examined by each level of the trie walk, the type
+//found at each, and the result of the walk. An entry whose site is
+//-1 is empty.
+#define DISPATCH_CACHE_SITES 1024
+#define DISPATCH_CACHE_WAYS 4
+#define DISPATCH_CACHE_DEPTH 4
+
+typedef struct{
+  int32_t site;
+  int32_t depth;
+  int32_t result;
+  int32_t args[DISPATCH_CACHE_DEPTH];
+  int32_t types[DISPATCH_CACHE_DEPTH];
+} DispatchCacheEntry;
+
+typedef struct{
+  DispatchCacheEntry entries[DISPATCH_CACHE_WAYS];
+  int32_t next_way;
+} DispatchCacheSet;
+
+//Execution counts gathered while profiling. Only the leading
+//fields are accessed from Stanza.
+typedef struct{
+  uint64_t num_functions;
+  uint64_t* function_counts;
+  uint64_t opcode_counts[256];
+  uint64_t opcode_cycles[256];
+  uint64_t opcode_samples[256];
+  uint64_t sample_countdown;
+  uint64_t sample_start;
+  uint64_t cycle_overhead;
+  int sampled_opcode;
+} VMProfile;
+
+//The most recent TRACE_LENGTH executed instructions, recorded while
+//tracing. TRACE_LENGTH must be a power of two. See TRACING below.
+#define TRACE_LENGTH 4096
+
+typedef struct{
+  uint32_t pc;
+  uint32_t opcode;
+  uint64_t time;
+} TraceEntry;
+
+typedef struct{
+  uint64_t count;
+  TraceEntry entries[TRACE_LENGTH];
+} VMTrace;
+
+//Allocations sampled while sampling allocations. Each sample stands
+//for count times the sampling interval in allocated bytes. Accessed
+//from Stanza. See ALLOCATION SAMPLING below.
+typedef struct{
+  uint32_t pc;
+  int32_t type;
+  int64_t count;
+} AllocSample;
+
+typedef struct{
+  int64_t interval;
+  int64_t countdown;
+  uint64_t num_samples;
+  uint64_t capacity;
+  AllocSample* samples;
+} VMAllocSampler;
+
 typedef struct{
   //Permanent State
   //Changes in-between each code load
@@ -412,6 +594,19 @@ typedef struct{
   uint64_t* system_registers;
   //Trie table
   void** trie_table;
+  //Inline caches for dispatch instructions
+  DispatchCacheSet* dispatch_cache;
+  //Profiling counts, or NULL if not profiling
+  VMProfile* profile;
+  //Function entry counts, and the functions that have become hot
+  uint32_t* entry_counts;
+  int32_t* hot_functions;
+  uint64_t num_entry_counts;
+  uint64_t num_hot_functions;
+  //Instruction trace, or NULL if not tracing
+  VMTrace* trace;
+  //Allocation sampler, or NULL if not sampling allocations
+  VMAllocSampler* alloc_sampler;
 } VMState;
 
 typedef struct{
@@ -440,12 +635,695 @@ typedef struct{
 int call_garbage_collector (VMState* vms, uint64_t total_size);
 void call_print_stack_trace (VMState* vms, uint64_t stack);
 char* retrieve_class_name (VMState* vms, long id);
+void call_encode_function (VMState* vms, uint64_t fid);
+void call_record_sample (VMState* vms, uint64_t pc);
 void c_trampoline (void* fptr, void* argbuffer, void* retbuffer);
 
 //============================================================
 //=================== Forward Declarations ===================
 //============================================================
 int read_dispatch_table (VMState* vms, int format);
+int cached_dispatch (VMState* vms, int site, int format);
+void stop_vm_profile (VMState* vms);
+void update_entry_counts (VMState* vms, uint64_t num_functions);
+void update_vm_profile (VMState* vms, uint64_t num_functions);
+void stop_vm_trace (VMState* vms);
+void stop_vm_alloc_sampler (VMState* vms);
+
+//============================================================
+//=================== HOT FUNCTIONS ==========================
+//============================================================
+
+//When VM_COUNT_ENTRIES is defined, each function counts the number
+//of times it is called, up to HOT_FUNCTION_THRESHOLD. The function
+//that reaches the threshold is added to the hot_functions list, which
+//is drained from Stanza, and identifies the functions worth compiling
+//to native code. This is kept out of the default build because it
+//costs a counter update on every call.
+
+#define HOT_FUNCTION_THRESHOLD 10000
+
+#ifdef VM_COUNT_ENTRIES
+  #define COUNT_ENTRY(fid) \
+    if(vms->entry_counts[fid] < HOT_FUNCTION_THRESHOLD && \
+       ++vms->entry_counts[fid] == HOT_FUNCTION_THRESHOLD) \
+      vms->hot_functions[vms->num_hot_functions++] = fid;
+#else
+  #define COUNT_ENTRY(fid)
+#endif
+
+//Called whenever new code has been loaded into the VM. A function
+//can reach the threshold only once, so the hot_functions list never
+//needs more than one slot per function.
+void update_entry_counts (VMState* vms, uint64_t num_functions){
+  #ifndef VM_COUNT_ENTRIES
+    return;
+  #endif
+  if(num_functions <= vms->num_entry_counts) return;
+  vms->entry_counts = (uint32_t*)realloc(vms->entry_counts, num_functions * sizeof(uint32_t));
+  vms->hot_functions = (int32_t*)realloc(vms->hot_functions, num_functions * sizeof(int32_t));
+  if(vms->entry_counts == NULL || vms->hot_functions == NULL){
+    printf("Could not allocate function entry counts.\n");
+    exit(-1);
+  }
+  for(uint64_t i=vms->num_entry_counts; i<num_functions; i++)
+    vms->entry_counts[i] = 0;
+  vms->num_entry_counts = num_functions;
+}
+
+//============================================================
+//===================== OPCODE NAMES =========================
+//============================================================
+
+static const char* opcode_names[256] = {
+  [SET_OPCODE_LOCAL] = "SET_OPCODE_LOCAL",
+  [SET_OPCODE_UNSIGNED] = "SET_OPCODE_UNSIGNED",
+  [SET_OPCODE_SIGNED] = "SET_OPCODE_SIGNED",
+  [SET_OPCODE_CODE] = "SET_OPCODE_CODE",
+  [SET_OPCODE_SHORT] = "SET_OPCODE_SHORT",
+  [SET_OPCODE_GLOBAL] = "SET_OPCODE_GLOBAL",
+  [SET_OPCODE_DATA] = "SET_OPCODE_DATA",
+  [SET_OPCODE_CONST] = "SET_OPCODE_CONST",
+  [SET_OPCODE_WIDE] = "SET_OPCODE_WIDE",
+  [SET_REG_OPCODE_LOCAL] = "SET_REG_OPCODE_LOCAL",
+  [SET_REG_OPCODE_UNSIGNED] = "SET_REG_OPCODE_UNSIGNED",
+  [SET_REG_OPCODE_SIGNED] = "SET_REG_OPCODE_SIGNED",
+  [SET_REG_OPCODE_CODE] = "SET_REG_OPCODE_CODE",
+  [SET_REG_OPCODE_SHORT] = "SET_REG_OPCODE_SHORT",
+  [SET_REG_OPCODE_GLOBAL] = "SET_REG_OPCODE_GLOBAL",
+  [SET_REG_OPCODE_DATA] = "SET_REG_OPCODE_DATA",
+  [SET_REG_OPCODE_CONST] = "SET_REG_OPCODE_CONST",
+  [SET_REG_OPCODE_WIDE] = "SET_REG_OPCODE_WIDE",
+  [GET_REG_OPCODE] = "GET_REG_OPCODE",
+  [CALL_OPCODE_LOCAL] = "CALL_OPCODE_LOCAL",
+  [CALL_OPCODE_CODE] = "CALL_OPCODE_CODE",
+  [CALL_CLOSURE_OPCODE] = "CALL_CLOSURE_OPCODE",
+  [TCALL_OPCODE_LOCAL] = "TCALL_OPCODE_LOCAL",
+  [TCALL_OPCODE_CODE] = "TCALL_OPCODE_CODE",
+  [TCALL_CLOSURE_OPCODE] = "TCALL_CLOSURE_OPCODE",
+  [CALLC_OPCODE_LOCAL] = "CALLC_OPCODE_LOCAL",
+  [CALLC_OPCODE_WIDE] = "CALLC_OPCODE_WIDE",
+  [CALLC_DIRECT_OPCODE_LOCAL] = "CALLC_DIRECT_OPCODE_LOCAL",
+  [CALLC_DIRECT_OPCODE_WIDE] = "CALLC_DIRECT_OPCODE_WIDE",
+  [POP_FRAME_OPCODE] = "POP_FRAME_OPCODE",
+  [LIVE_OPCODE] = "LIVE_OPCODE",
+  [YIELD_OPCODE] = "YIELD_OPCODE",
+  [RETURN_OPCODE] = "RETURN_OPCODE",
+  [DUMP_OPCODE] = "DUMP_OPCODE",
+  [INT_ADD_OPCODE] = "INT_ADD_OPCODE",
+  [INT_SUB_OPCODE] = "INT_SUB_OPCODE",
+  [INT_MUL_OPCODE] = "INT_MUL_OPCODE",
+  [INT_DIV_OPCODE] = "INT_DIV_OPCODE",
+  [INT_MOD_OPCODE] = "INT_MOD_OPCODE",
+  [INT_AND_OPCODE] = "INT_AND_OPCODE",
+  [INT_OR_OPCODE] = "INT_OR_OPCODE",
+  [INT_XOR_OPCODE] = "INT_XOR_OPCODE",
+  [INT_SHL_OPCODE] = "INT_SHL_OPCODE",
+  [INT_SHR_OPCODE] = "INT_SHR_OPCODE",
+  [INT_ASHR_OPCODE] = "INT_ASHR_OPCODE",
+  [INT_LT_OPCODE] = "INT_LT_OPCODE",
+  [INT_GT_OPCODE] = "INT_GT_OPCODE",
+  [INT_LE_OPCODE] = "INT_LE_OPCODE",
+  [INT_GE_OPCODE] = "INT_GE_OPCODE",
+  [EQ_OPCODE_REF_REF] = "EQ_OPCODE_REF_REF",
+  [EQ_OPCODE_REF] = "EQ_OPCODE_REF",
+  [EQ_OPCODE_BYTE] = "EQ_OPCODE_BYTE",
+  [EQ_OPCODE_INT] = "EQ_OPCODE_INT",
+  [EQ_OPCODE_LONG] = "EQ_OPCODE_LONG",
+  [EQ_OPCODE_FLOAT] = "EQ_OPCODE_FLOAT",
+  [EQ_OPCODE_DOUBLE] = "EQ_OPCODE_DOUBLE",
+  [NE_OPCODE_REF_REF] = "NE_OPCODE_REF_REF",
+  [NE_OPCODE_REF] = "NE_OPCODE_REF",
+  [NE_OPCODE_BYTE] = "NE_OPCODE_BYTE",
+  [NE_OPCODE_INT] = "NE_OPCODE_INT",
+  [NE_OPCODE_LONG] = "NE_OPCODE_LONG",
+  [NE_OPCODE_FLOAT] = "NE_OPCODE_FLOAT",
+  [NE_OPCODE_DOUBLE] = "NE_OPCODE_DOUBLE",
+  [ADD_OPCODE_BYTE] = "ADD_OPCODE_BYTE",
+  [ADD_OPCODE_INT] = "ADD_OPCODE_INT",
+  [ADD_OPCODE_LONG] = "ADD_OPCODE_LONG",
+  [ADD_OPCODE_FLOAT] = "ADD_OPCODE_FLOAT",
+  [ADD_OPCODE_DOUBLE] = "ADD_OPCODE_DOUBLE",
+  [SUB_OPCODE_BYTE] = "SUB_OPCODE_BYTE",
+  [SUB_OPCODE_INT] = "SUB_OPCODE_INT",
+  [SUB_OPCODE_LONG] = "SUB_OPCODE_LONG",
+  [SUB_OPCODE_FLOAT] = "SUB_OPCODE_FLOAT",
+  [SUB_OPCODE_DOUBLE] = "SUB_OPCODE_DOUBLE",
+  [MUL_OPCODE_BYTE] = "MUL_OPCODE_BYTE",
+  [MUL_OPCODE_INT] = "MUL_OPCODE_INT",
+  [MUL_OPCODE_LONG] = "MUL_OPCODE_LONG",
+  [MUL_OPCODE_FLOAT] = "MUL_OPCODE_FLOAT",
+  [MUL_OPCODE_DOUBLE] = "MUL_OPCODE_DOUBLE",
+  [DIV_OPCODE_BYTE] = "DIV_OPCODE_BYTE",
+  [DIV_OPCODE_INT] = "DIV_OPCODE_INT",
+  [DIV_OPCODE_LONG] = "DIV_OPCODE_LONG",
+  [DIV_OPCODE_FLOAT] = "DIV_OPCODE_FLOAT",
+  [DIV_OPCODE_DOUBLE] = "DIV_OPCODE_DOUBLE",
+  [MOD_OPCODE_BYTE] = "MOD_OPCODE_BYTE",
+  [MOD_OPCODE_INT] = "MOD_OPCODE_INT",
+  [MOD_OPCODE_LONG] = "MOD_OPCODE_LONG",
+  [AND_OPCODE_BYTE] = "AND_OPCODE_BYTE",
+  [AND_OPCODE_INT] = "AND_OPCODE_INT",
+  [AND_OPCODE_LONG] = "AND_OPCODE_LONG",
+  [OR_OPCODE_BYTE] = "OR_OPCODE_BYTE",
+  [OR_OPCODE_INT] = "OR_OPCODE_INT",
+  [OR_OPCODE_LONG] = "OR_OPCODE_LONG",
+  [XOR_OPCODE_BYTE] = "XOR_OPCODE_BYTE",
+  [XOR_OPCODE_INT] = "XOR_OPCODE_INT",
+  [XOR_OPCODE_LONG] = "XOR_OPCODE_LONG",
+  [SHL_OPCODE_BYTE] = "SHL_OPCODE_BYTE",
+  [SHL_OPCODE_INT] = "SHL_OPCODE_INT",
+  [SHL_OPCODE_LONG] = "SHL_OPCODE_LONG",
+  [SHR_OPCODE_BYTE] = "SHR_OPCODE_BYTE",
+  [SHR_OPCODE_INT] = "SHR_OPCODE_INT",
+  [SHR_OPCODE_LONG] = "SHR_OPCODE_LONG",
+  [ASHR_OPCODE_INT] = "ASHR_OPCODE_INT",
+  [ASHR_OPCODE_LONG] = "ASHR_OPCODE_LONG",
+  [LT_OPCODE_INT] = "LT_OPCODE_INT",
+  [LT_OPCODE_LONG] = "LT_OPCODE_LONG",
+  [LT_OPCODE_FLOAT] = "LT_OPCODE_FLOAT",
+  [LT_OPCODE_DOUBLE] = "LT_OPCODE_DOUBLE",
+  [GT_OPCODE_INT] = "GT_OPCODE_INT",
+  [GT_OPCODE_LONG] = "GT_OPCODE_LONG",
+  [GT_OPCODE_FLOAT] = "GT_OPCODE_FLOAT",
+  [GT_OPCODE_DOUBLE] = "GT_OPCODE_DOUBLE",
+  [LE_OPCODE_INT] = "LE_OPCODE_INT",
+  [LE_OPCODE_LONG] = "LE_OPCODE_LONG",
+  [LE_OPCODE_FLOAT] = "LE_OPCODE_FLOAT",
+  [LE_OPCODE_DOUBLE] = "LE_OPCODE_DOUBLE",
+  [GE_OPCODE_INT] = "GE_OPCODE_INT",
+  [GE_OPCODE_LONG] = "GE_OPCODE_LONG",
+  [GE_OPCODE_FLOAT] = "GE_OPCODE_FLOAT",
+  [GE_OPCODE_DOUBLE] = "GE_OPCODE_DOUBLE",
+  [ULE_OPCODE_BYTE] = "ULE_OPCODE_BYTE",
+  [ULE_OPCODE_INT] = "ULE_OPCODE_INT",
+  [ULE_OPCODE_LONG] = "ULE_OPCODE_LONG",
+  [ULT_OPCODE_BYTE] = "ULT_OPCODE_BYTE",
+  [ULT_OPCODE_INT] = "ULT_OPCODE_INT",
+  [ULT_OPCODE_LONG] = "ULT_OPCODE_LONG",
+  [UGT_OPCODE_BYTE] = "UGT_OPCODE_BYTE",
+  [UGT_OPCODE_INT] = "UGT_OPCODE_INT",
+  [UGT_OPCODE_LONG] = "UGT_OPCODE_LONG",
+  [UGE_OPCODE_BYTE] = "UGE_OPCODE_BYTE",
+  [UGE_OPCODE_INT] = "UGE_OPCODE_INT",
+  [UGE_OPCODE_LONG] = "UGE_OPCODE_LONG",
+  [INT_NOT_OPCODE] = "INT_NOT_OPCODE",
+  [INT_NEG_OPCODE] = "INT_NEG_OPCODE",
+  [NOT_OPCODE_BYTE] = "NOT_OPCODE_BYTE",
+  [NOT_OPCODE_INT] = "NOT_OPCODE_INT",
+  [NOT_OPCODE_LONG] = "NOT_OPCODE_LONG",
+  [NEG_OPCODE_INT] = "NEG_OPCODE_INT",
+  [NEG_OPCODE_LONG] = "NEG_OPCODE_LONG",
+  [NEG_OPCODE_FLOAT] = "NEG_OPCODE_FLOAT",
+  [NEG_OPCODE_DOUBLE] = "NEG_OPCODE_DOUBLE",
+  [DEREF_OPCODE] = "DEREF_OPCODE",
+  [TYPEOF_OPCODE] = "TYPEOF_OPCODE",
+  [JUMP_SET_OPCODE] = "JUMP_SET_OPCODE",
+  [JUMP_TAGBITS_OPCODE] = "JUMP_TAGBITS_OPCODE",
+  [JUMP_TAGWORD_OPCODE] = "JUMP_TAGWORD_OPCODE",
+  [GOTO_OPCODE] = "GOTO_OPCODE",
+  [CONV_OPCODE_BYTE_FLOAT] = "CONV_OPCODE_BYTE_FLOAT",
+  [CONV_OPCODE_BYTE_DOUBLE] = "CONV_OPCODE_BYTE_DOUBLE",
+  [CONV_OPCODE_INT_BYTE] = "CONV_OPCODE_INT_BYTE",
+  [CONV_OPCODE_INT_FLOAT] = "CONV_OPCODE_INT_FLOAT",
+  [CONV_OPCODE_INT_DOUBLE] = "CONV_OPCODE_INT_DOUBLE",
+  [CONV_OPCODE_LONG_BYTE] = "CONV_OPCODE_LONG_BYTE",
+  [CONV_OPCODE_LONG_INT] = "CONV_OPCODE_LONG_INT",
+  [CONV_OPCODE_LONG_FLOAT] = "CONV_OPCODE_LONG_FLOAT",
+  [CONV_OPCODE_LONG_DOUBLE] = "CONV_OPCODE_LONG_DOUBLE",
+  [CONV_OPCODE_FLOAT_BYTE] = "CONV_OPCODE_FLOAT_BYTE",
+  [CONV_OPCODE_FLOAT_INT] = "CONV_OPCODE_FLOAT_INT",
+  [CONV_OPCODE_FLOAT_LONG] = "CONV_OPCODE_FLOAT_LONG",
+  [CONV_OPCODE_FLOAT_DOUBLE] = "CONV_OPCODE_FLOAT_DOUBLE",
+  [CONV_OPCODE_DOUBLE_BYTE] = "CONV_OPCODE_DOUBLE_BYTE",
+  [CONV_OPCODE_DOUBLE_INT] = "CONV_OPCODE_DOUBLE_INT",
+  [CONV_OPCODE_DOUBLE_LONG] = "CONV_OPCODE_DOUBLE_LONG",
+  [CONV_OPCODE_DOUBLE_FLOAT] = "CONV_OPCODE_DOUBLE_FLOAT",
+  [DETAG_OPCODE] = "DETAG_OPCODE",
+  [TAG_OPCODE_BYTE] = "TAG_OPCODE_BYTE",
+  [TAG_OPCODE_CHAR] = "TAG_OPCODE_CHAR",
+  [TAG_OPCODE_INT] = "TAG_OPCODE_INT",
+  [TAG_OPCODE_FLOAT] = "TAG_OPCODE_FLOAT",
+  [STORE_OPCODE_1] = "STORE_OPCODE_1",
+  [STORE_OPCODE_4] = "STORE_OPCODE_4",
+  [STORE_OPCODE_8] = "STORE_OPCODE_8",
+  [STORE_OPCODE_1_VAR_OFFSET] = "STORE_OPCODE_1_VAR_OFFSET",
+  [STORE_OPCODE_4_VAR_OFFSET] = "STORE_OPCODE_4_VAR_OFFSET",
+  [STORE_OPCODE_8_VAR_OFFSET] = "STORE_OPCODE_8_VAR_OFFSET",
+  [LOAD_OPCODE_1] = "LOAD_OPCODE_1",
+  [LOAD_OPCODE_4] = "LOAD_OPCODE_4",
+  [LOAD_OPCODE_8] = "LOAD_OPCODE_8",
+  [LOAD_OPCODE_1_VAR_OFFSET] = "LOAD_OPCODE_1_VAR_OFFSET",
+  [LOAD_OPCODE_4_VAR_OFFSET] = "LOAD_OPCODE_4_VAR_OFFSET",
+  [LOAD_OPCODE_8_VAR_OFFSET] = "LOAD_OPCODE_8_VAR_OFFSET",
+  [RESERVE_OPCODE_LOCAL] = "RESERVE_OPCODE_LOCAL",
+  [RESERVE_OPCODE_CONST] = "RESERVE_OPCODE_CONST",
+  [ENTER_STACK_OPCODE] = "ENTER_STACK_OPCODE",
+  [ALLOC_OPCODE_CONST] = "ALLOC_OPCODE_CONST",
+  [ALLOC_OPCODE_LOCAL] = "ALLOC_OPCODE_LOCAL",
+  [GC_OPCODE] = "GC_OPCODE",
+  [CLASS_NAME_OPCODE] = "CLASS_NAME_OPCODE",
+  [PRINT_STACK_TRACE_OPCODE] = "PRINT_STACK_TRACE_OPCODE",
+  [FLUSH_VM_OPCODE] = "FLUSH_VM_OPCODE",
+  [C_RSP_OPCODE] = "C_RSP_OPCODE",
+  [JUMP_INT_LT_OPCODE] = "JUMP_INT_LT_OPCODE",
+  [JUMP_INT_GT_OPCODE] = "JUMP_INT_GT_OPCODE",
+  [JUMP_INT_LE_OPCODE] = "JUMP_INT_LE_OPCODE",
+  [JUMP_INT_GE_OPCODE] = "JUMP_INT_GE_OPCODE",
+  [JUMP_EQ_OPCODE_REF] = "JUMP_EQ_OPCODE_REF",
+  [JUMP_EQ_OPCODE_BYTE] = "JUMP_EQ_OPCODE_BYTE",
+  [JUMP_EQ_OPCODE_INT] = "JUMP_EQ_OPCODE_INT",
+  [JUMP_EQ_OPCODE_LONG] = "JUMP_EQ_OPCODE_LONG",
+  [JUMP_EQ_OPCODE_FLOAT] = "JUMP_EQ_OPCODE_FLOAT",
+  [JUMP_EQ_OPCODE_DOUBLE] = "JUMP_EQ_OPCODE_DOUBLE",
+  [JUMP_NE_OPCODE_REF] = "JUMP_NE_OPCODE_REF",
+  [JUMP_NE_OPCODE_BYTE] = "JUMP_NE_OPCODE_BYTE",
+  [JUMP_NE_OPCODE_INT] = "JUMP_NE_OPCODE_INT",
+  [JUMP_NE_OPCODE_LONG] = "JUMP_NE_OPCODE_LONG",
+  [JUMP_NE_OPCODE_FLOAT] = "JUMP_NE_OPCODE_FLOAT",
+  [JUMP_NE_OPCODE_DOUBLE] = "JUMP_NE_OPCODE_DOUBLE",
+  [JUMP_LT_OPCODE_INT] = "JUMP_LT_OPCODE_INT",
+  [JUMP_LT_OPCODE_LONG] = "JUMP_LT_OPCODE_LONG",
+  [JUMP_LT_OPCODE_FLOAT] = "JUMP_LT_OPCODE_FLOAT",
+  [JUMP_LT_OPCODE_DOUBLE] = "JUMP_LT_OPCODE_DOUBLE",
+  [JUMP_GT_OPCODE_INT] = "JUMP_GT_OPCODE_INT",
+  [JUMP_GT_OPCODE_LONG] = "JUMP_GT_OPCODE_LONG",
+  [JUMP_GT_OPCODE_FLOAT] = "JUMP_GT_OPCODE_FLOAT",
+  [JUMP_GT_OPCODE_DOUBLE] = "JUMP_GT_OPCODE_DOUBLE",
+  [JUMP_LE_OPCODE_INT] = "JUMP_LE_OPCODE_INT",
+  [JUMP_LE_OPCODE_LONG] = "JUMP_LE_OPCODE_LONG",
+  [JUMP_LE_OPCODE_FLOAT] = "JUMP_LE_OPCODE_FLOAT",
+  [JUMP_LE_OPCODE_DOUBLE] = "JUMP_LE_OPCODE_DOUBLE",
+  [JUMP_GE_OPCODE_INT] = "JUMP_GE_OPCODE_INT",
+  [JUMP_GE_OPCODE_LONG] = "JUMP_GE_OPCODE_LONG",
+  [JUMP_GE_OPCODE_FLOAT] = "JUMP_GE_OPCODE_FLOAT",
+  [JUMP_GE_OPCODE_DOUBLE] = "JUMP_GE_OPCODE_DOUBLE",
+  [JUMP_ULE_OPCODE_BYTE] = "JUMP_ULE_OPCODE_BYTE",
+  [JUMP_ULE_OPCODE_INT] = "JUMP_ULE_OPCODE_INT",
+  [JUMP_ULE_OPCODE_LONG] = "JUMP_ULE_OPCODE_LONG",
+  [JUMP_ULT_OPCODE_BYTE] = "JUMP_ULT_OPCODE_BYTE",
+  [JUMP_ULT_OPCODE_INT] = "JUMP_ULT_OPCODE_INT",
+  [JUMP_ULT_OPCODE_LONG] = "JUMP_ULT_OPCODE_LONG",
+  [JUMP_UGT_OPCODE_BYTE] = "JUMP_UGT_OPCODE_BYTE",
+  [JUMP_UGT_OPCODE_INT] = "JUMP_UGT_OPCODE_INT",
+  [JUMP_UGT_OPCODE_LONG] = "JUMP_UGT_OPCODE_LONG",
+  [JUMP_UGE_OPCODE_BYTE] = "JUMP_UGE_OPCODE_BYTE",
+  [JUMP_UGE_OPCODE_INT] = "JUMP_UGE_OPCODE_INT",
+  [JUMP_UGE_OPCODE_LONG] = "JUMP_UGE_OPCODE_LONG",
+  [DISPATCH_OPCODE] = "DISPATCH_OPCODE",
+  [DISPATCH_METHOD_OPCODE] = "DISPATCH_METHOD_OPCODE",
+  [JUMP_REG_OPCODE] = "JUMP_REG_OPCODE",
+  [FNENTRY_OPCODE] = "FNENTRY_OPCODE",
+  [LAZY_ENTRY_OPCODE] = "LAZY_ENTRY_OPCODE",
+};
+
+const char* opcode_name (int opcode){
+  const char* name = opcode_names[opcode];
+  return name == NULL ? "UNKNOWN_OPCODE" : name;
+}
+
+//============================================================
+//===================== VM PROFILING =========================
+//============================================================
+
+//The cost of an opcode is measured on one out of every
+//PROFILE_SAMPLE_PERIOD executed instructions, as the number of
+//cycles between its fetch and the fetch of the next instruction.
+
+#define PROFILE_SAMPLE_PERIOD 97
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define READ_CYCLES() __builtin_ia32_rdtsc()
+#else
+  #define READ_CYCLES() 0
+#endif
+
+static inline void profile_opcode (VMProfile* p, int opcode){
+  p->opcode_counts[opcode]++;
+  if(p->sampled_opcode >= 0){
+    p->opcode_cycles[p->sampled_opcode] += READ_CYCLES() - p->sample_start;
+    p->opcode_samples[p->sampled_opcode]++;
+    p->sampled_opcode = -1;
+  }
+  if(--p->sample_countdown == 0){
+    p->sample_countdown = PROFILE_SAMPLE_PERIOD;
+    p->sampled_opcode = opcode;
+    p->sample_start = READ_CYCLES();
+  }
+}
+
+//The cost of reading the cycle counter itself, which is subtracted
+//from each measurement.
+static uint64_t cycle_counter_overhead (void){
+  uint64_t best = (uint64_t)-1;
+  for(int i=0; i<64; i++){
+    uint64_t t0 = READ_CYCLES();
+    uint64_t t1 = READ_CYCLES();
+    if(t1 - t0 < best) best = t1 - t0;
+  }
+  return best;
+}
+
+//Install a fresh profile, discarding any existing one.
+void start_vm_profile (VMState* vms, uint64_t num_functions){
+  stop_vm_profile(vms);
+  VMProfile* p = (VMProfile*)calloc(1, sizeof(VMProfile));
+  p->sample_countdown = PROFILE_SAMPLE_PERIOD;
+  p->cycle_overhead = cycle_counter_overhead();
+  p->sampled_opcode = -1;
+  vms->profile = p;
+  update_vm_profile(vms, num_functions);
+}
+
+//Called whenever new code has been loaded into the VM, so that newly
+//loaded functions are counted as well.
+void update_vm_profile (VMState* vms, uint64_t num_functions){
+  VMProfile* p = vms->profile;
+  if(p == NULL || num_functions <= p->num_functions) return;
+  p->function_counts = (uint64_t*)realloc(p->function_counts, num_functions * sizeof(uint64_t));
+  for(uint64_t i=p->num_functions; i<num_functions; i++)
+    p->function_counts[i] = 0;
+  p->num_functions = num_functions;
+}
+
+void stop_vm_profile (VMState* vms){
+  VMProfile* p = vms->profile;
+  if(p == NULL) return;
+  free(p->function_counts);
+  free(p);
+  vms->profile = NULL;
+}
+
+static uint64_t* sorting_counts;
+
+static int compare_opcode_counts (const void* a, const void* b){
+  uint64_t ca = sorting_counts[*(int*)a];
+  uint64_t cb = sorting_counts[*(int*)b];
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+//Print the opcode counts, most frequent first.
+void print_opcode_profile (VMState* vms){
+  VMProfile* p = vms->profile;
+  if(p == NULL) return;
+  #ifndef VM_PROFILE_OPCODES
+  printf("Opcodes are not counted unless the VM is compiled with VM_PROFILE_OPCODES.\n");
+  return;
+  #endif
+  int opcodes[256];
+  uint64_t total = 0;
+  for(int i=0; i<256; i++){
+    opcodes[i] = i;
+    total += p->opcode_counts[i];
+  }
+  sorting_counts = p->opcode_counts;
+  qsort(opcodes, 256, sizeof(int), compare_opcode_counts);
+  printf("Opcode profile (%" PRIu64 " instructions executed):\n", total);
+  printf("  %-28s %14s %8s %12s\n", "OPCODE", "COUNT", "PERCENT", "CYCLES/INS");
+  for(int i=0; i<256; i++){
+    int op = opcodes[i];
+    uint64_t count = p->opcode_counts[op];
+    if(count == 0) break;
+    printf("  %-28s %14" PRIu64 " %7.2f%%", opcode_name(op), count, 100.0 * count / total);
+    if(p->opcode_samples[op] > 0){
+      double cycles = (double)p->opcode_cycles[op] / p->opcode_samples[op] - p->cycle_overhead;
+      printf(" %12.1f", cycles < 0 ? 0 : cycles);
+    }
+    printf("\n");
+  }
+}
+
+//============================================================
+//================ OPCODE PAIR PROFILING =====================
+//============================================================
+
+#ifdef VM_PROFILE_OPCODE_PAIRS
+
+#define NUM_PRINTED_OPCODE_PAIRS 64
+
+static uint64_t opcode_pair_counts[256][256];
+
+typedef struct{
+  int first;
+  int second;
+  uint64_t count;
+} OpcodePair;
+
+static int compare_opcode_pairs (const void* a, const void* b){
+  uint64_t ca = ((OpcodePair*)a)->count;
+  uint64_t cb = ((OpcodePair*)b)->count;
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void print_opcode_pair_profile (void){
+  OpcodePair* pairs = (OpcodePair*)malloc(256 * 256 * sizeof(OpcodePair));
+  int num_pairs = 0;
+  uint64_t total = 0;
+  for(int i=0; i<256; i++)
+    for(int j=0; j<256; j++)
+      if(opcode_pair_counts[i][j] > 0){
+        pairs[num_pairs].first = i;
+        pairs[num_pairs].second = j;
+        pairs[num_pairs].count = opcode_pair_counts[i][j];
+        total += opcode_pair_counts[i][j];
+        num_pairs++;
+      }
+  qsort(pairs, num_pairs, sizeof(OpcodePair), compare_opcode_pairs);
+  printf("Opcode pair profile (%" PRIu64 " pairs executed):\n", total);
+  for(int i=0; i<num_pairs && i<NUM_PRINTED_OPCODE_PAIRS; i++)
+    printf("  %-28s -> %-28s : %12" PRIu64 " (%5.2f%%)\n",
+           opcode_name(pairs[i].first), opcode_name(pairs[i].second), pairs[i].count,
+           100.0 * pairs[i].count / total);
+  free(pairs);
+}
+
+#endif
+
+//============================================================
+//==================== DIRECT C CALLS ========================
+//============================================================
+
+//Calls whose arguments all fit in registers on a System V platform
+//are made directly from C instead of through c_trampoline. The
+//encoder places integer argument i in registers[i], and real
+//argument i in registers[DIRECT_CALLC_FREGS + i].
+//
+//The function is called with all six integer and eight real argument
+//registers filled. The callee ignores the ones it does not use. The
+//real arguments are passed through the variadic part of the
+//prototype so that %al holds the number of vector registers, as
+//variadic callees require. The CResult return type is returned in
+//%rax and %xmm0, so both possible return registers are retrieved,
+//as c_trampoline does.
+
+#define DIRECT_CALLC_FREGS 8
+
+typedef struct{
+  uint64_t rax;
+  double xmm0;
+} CResult;
+
+typedef CResult (*DirectCFn)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, ...);
+
+static inline double freg_arg (uint64_t* registers, int i){
+  double d;
+  memcpy(&d, &registers[DIRECT_CALLC_FREGS + i], 8);
+  return d;
+}
+
+static void direct_callc (void* fptr, uint64_t* registers){
+  #ifdef PLATFORM_WINDOWS
+    printf("Direct C calls are not supported on this platform.\n");
+    exit(-1);
+  #else
+    CResult r = ((DirectCFn)fptr)(
+      registers[0], registers[1], registers[2], registers[3], registers[4], registers[5],
+      freg_arg(registers, 0), freg_arg(registers, 1), freg_arg(registers, 2), freg_arg(registers, 3),
+      freg_arg(registers, 4), freg_arg(registers, 5), freg_arg(registers, 6), freg_arg(registers, 7));
+    registers[0] = r.rax;
+    memcpy(&registers[1], &r.xmm0, 8);
+  #endif
+}
+
+//============================================================
+//=================== SAMPLING PROFILER ======================
+//============================================================
+
+//While the sampler is running, SIGPROF is delivered after every
+//interval of CPU time used by the process. The handler only sets
+//vm_sample_pending, and the VM takes the sample at its next safe
+//point, where the pc and the stack frames are consistent.
+
+#ifdef PLATFORM_WINDOWS
+  static int vm_sample_pending = 0;
+
+  int start_vm_sampler (uint64_t interval_us){
+    return 0;
+  }
+
+  void stop_vm_sampler (void){}
+#else
+  static volatile sig_atomic_t vm_sample_pending = 0;
+  static struct sigaction saved_sigprof_action;
+
+  static void handle_sigprof (int sig){
+    (void)sig;
+    vm_sample_pending = 1;
+  }
+
+  //Returns 1 if the sampler was started.
+  int start_vm_sampler (uint64_t interval_us){
+    struct sigaction action;
+    action.sa_handler = handle_sigprof;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if(sigaction(SIGPROF, &action, &saved_sigprof_action) != 0) return 0;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    if(setitimer(ITIMER_PROF, &timer, NULL) != 0){
+      sigaction(SIGPROF, &saved_sigprof_action, NULL);
+      return 0;
+    }
+    vm_sample_pending = 0;
+    return 1;
+  }
+
+  void stop_vm_sampler (void){
+    struct itimerval timer = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &saved_sigprof_action, NULL);
+    vm_sample_pending = 0;
+  }
+#endif
+
+//Discard a sample requested while the VM was not running, so that
+//time spent outside of the VM is not attributed to it.
+void reset_vm_sampler (void){
+  vm_sample_pending = 0;
+}
+
+//============================================================
+//======================== TRACING ===========================
+//============================================================
+
+//While tracing, every executed instruction is written into a ring
+//buffer holding the most recent TRACE_LENGTH instructions. The
+//buffer is printed when the program prints a stack trace, when the
+//VM encounters an invalid opcode, or on demand.
+
+static inline void trace_ins (VMTrace* t, uint32_t pc, int opcode){
+  TraceEntry* e = &t->entries[t->count & (TRACE_LENGTH - 1)];
+  e->pc = pc;
+  e->opcode = (uint32_t)opcode;
+  e->time = READ_CYCLES();
+  t->count++;
+}
+
+//Install a fresh trace, discarding any existing one.
+void start_vm_trace (VMState* vms){
+  stop_vm_trace(vms);
+  #ifdef VM_TRACE
+  vms->trace = (VMTrace*)calloc(1, sizeof(VMTrace));
+  #else
+  printf("Instructions are not traced unless the VM is compiled with VM_TRACE.\n");
+  #endif
+}
+
+void stop_vm_trace (VMState* vms){
+  free(vms->trace);
+  vms->trace = NULL;
+}
+
+#define NUM_PRINTED_TRACE_GAPS 16
+
+//Print the buffered instructions, oldest first, with the number of
+//cycles until the next instruction was fetched, followed by the
+//instructions with the largest such gaps. The gap of the last
+//instruction is unknown.
+static void print_vm_trace (FILE* out, VMTrace* t){
+  uint64_t n = t->count < TRACE_LENGTH ? t->count : TRACE_LENGTH;
+  uint64_t start = t->count - n;
+  fprintf(out, "Instruction trace (last %" PRIu64 " of %" PRIu64 " instructions):\n", n, t->count);
+  fprintf(out, "  %10s %-28s %12s\n", "PC", "OPCODE", "CYCLES");
+  uint64_t gap_index[NUM_PRINTED_TRACE_GAPS];
+  uint64_t gap_cycles[NUM_PRINTED_TRACE_GAPS];
+  int num_gaps = 0;
+  for(uint64_t i=start; i<t->count; i++){
+    TraceEntry* e = &t->entries[i & (TRACE_LENGTH - 1)];
+    fprintf(out, "  %10" PRIu32 " %-28s", e->pc, opcode_name(e->opcode));
+    if(i + 1 < t->count){
+      uint64_t cycles = t->entries[(i + 1) & (TRACE_LENGTH - 1)].time - e->time;
+      fprintf(out, " %12" PRIu64, cycles);
+      //Insert into the largest gaps, kept in descending order
+      if(num_gaps < NUM_PRINTED_TRACE_GAPS || cycles > gap_cycles[num_gaps - 1]){
+        int j = num_gaps < NUM_PRINTED_TRACE_GAPS ? num_gaps++ : num_gaps - 1;
+        for(; j > 0 && gap_cycles[j - 1] < cycles; j--){
+          gap_index[j] = gap_index[j - 1];
+          gap_cycles[j] = gap_cycles[j - 1];
+        }
+        gap_index[j] = i;
+        gap_cycles[j] = cycles;
+      }
+    }
+    fprintf(out, "\n");
+  }
+  if(num_gaps > 0){
+    fprintf(out, "Slowest traced instructions:\n");
+    for(int j=0; j<num_gaps; j++){
+      TraceEntry* e = &t->entries[gap_index[j] & (TRACE_LENGTH - 1)];
+      fprintf(out, "  %10" PRIu32 " %-28s %12" PRIu64 "\n", e->pc, opcode_name(e->opcode), gap_cycles[j]);
+    }
+  }
+  fflush(out);
+}
+
+void dump_vm_trace (VMState* vms){
+  if(vms->trace != NULL) print_vm_trace(stdout, vms->trace);
+}
+
+//============================================================
+//================== ALLOCATION SAMPLING =====================
+//============================================================
+
+//The ALLOC instructions count down the number of allocated bytes,
+//and when the countdown runs out, the allocation is appended to the
+//sample buffer. The buffer is emptied by Stanza, which resolves the
+//positions and types of the samples before the code changes.
+
+static void sample_alloc (VMAllocSampler* s, uint32_t pc, int type, int64_t num_bytes){
+  s->countdown -= num_bytes;
+  if(__builtin_expect(s->countdown > 0, 1)) return;
+  //A large allocation may cross several multiples of the interval
+  int64_t count = 1 + (-s->countdown) / s->interval;
+  s->countdown += count * s->interval;
+  if(s->num_samples == s->capacity){
+    s->capacity = s->capacity == 0 ? 1024 : s->capacity * 2;
+    s->samples = (AllocSample*)realloc(s->samples, s->capacity * sizeof(AllocSample));
+  }
+  AllocSample* e = &s->samples[s->num_samples++];
+  e->pc = pc;
+  e->type = type;
+  e->count = count;
+}
+
+//Install a fresh allocation sampler, discarding any existing one.
+void start_vm_alloc_sampler (VMState* vms, int64_t interval){
+  stop_vm_alloc_sampler(vms);
+  VMAllocSampler* s = (VMAllocSampler*)calloc(1, sizeof(VMAllocSampler));
+  s->interval = interval;
+  s->countdown = interval;
+  vms->alloc_sampler = s;
+}
+
+void stop_vm_alloc_sampler (VMState* vms){
+  VMAllocSampler* s = vms->alloc_sampler;
+  if(s == NULL) return;
+  free(s->samples);
+  free(s);
+  vms->alloc_sampler = NULL;
+}
 
 //============================================================
 //===================== MAIN LOOP ============================
@@ -498,175 +1376,461 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
   char* stack_limit = (char*)(stk->frames) + stk->size;
   char* pc = instructions + stk->pc;  
 
-  //Timing
-  //uint64_t* timings = (uint64_t*)malloc(255 * sizeof(uint64_t));
-  //for(int i=0; i<255; i++) timings[i] = 0;
-  //int last_opcode = -1;
-  //uint64_t last_time;
+  //Opcode pair profiling
+  #ifdef VM_PROFILE_OPCODE_PAIRS
+  static int opcode_pair_profile_registered = 0;
+  if(!opcode_pair_profile_registered){
+    atexit(print_opcode_pair_profile);
+    opcode_pair_profile_registered = 1;
+  }
+  int prev_opcode = -1;
+  #endif
+
+  //Profiling
+  VMProfile* profile = vms->profile;
+  #ifdef VM_TRACE
+  VMTrace* trace = vms->trace;
+  #endif
+  VMAllocSampler* alloc_sampler = vms->alloc_sampler;
 
   //Debug
   //init_iprint();
 
+  //Threaded dispatch table
+  #ifdef USE_THREADED_DISPATCH
+  static void* dispatch_table[256] = {
+    [SET_OPCODE_LOCAL] = &&op_SET_OPCODE_LOCAL,
+    [SET_OPCODE_UNSIGNED] = &&op_SET_OPCODE_UNSIGNED,
+    [SET_OPCODE_SIGNED] = &&op_SET_OPCODE_SIGNED,
+    [SET_OPCODE_CODE] = &&op_SET_OPCODE_CODE,
+    [SET_OPCODE_SHORT] = &&op_SET_OPCODE_SHORT,
+    [SET_OPCODE_GLOBAL] = &&op_SET_OPCODE_GLOBAL,
+    [SET_OPCODE_DATA] = &&op_SET_OPCODE_DATA,
+    [SET_OPCODE_CONST] = &&op_SET_OPCODE_CONST,
+    [SET_OPCODE_WIDE] = &&op_SET_OPCODE_WIDE,
+    [SET_REG_OPCODE_LOCAL] = &&op_SET_REG_OPCODE_LOCAL,
+    [SET_REG_OPCODE_UNSIGNED] = &&op_SET_REG_OPCODE_UNSIGNED,
+    [SET_REG_OPCODE_SIGNED] = &&op_SET_REG_OPCODE_SIGNED,
+    [SET_REG_OPCODE_CODE] = &&op_SET_REG_OPCODE_CODE,
+    [SET_REG_OPCODE_SHORT] = &&op_SET_REG_OPCODE_SHORT,
+    [SET_REG_OPCODE_GLOBAL] = &&op_SET_REG_OPCODE_GLOBAL,
+    [SET_REG_OPCODE_DATA] = &&op_SET_REG_OPCODE_DATA,
+    [SET_REG_OPCODE_CONST] = &&op_SET_REG_OPCODE_CONST,
+    [SET_REG_OPCODE_WIDE] = &&op_SET_REG_OPCODE_WIDE,
+    [GET_REG_OPCODE] = &&op_GET_REG_OPCODE,
+    [CALL_OPCODE_LOCAL] = &&op_CALL_OPCODE_LOCAL,
+    [CALL_OPCODE_CODE] = &&op_CALL_OPCODE_CODE,
+    [CALL_CLOSURE_OPCODE] = &&op_CALL_CLOSURE_OPCODE,
+    [TCALL_OPCODE_LOCAL] = &&op_TCALL_OPCODE_LOCAL,
+    [TCALL_OPCODE_CODE] = &&op_TCALL_OPCODE_CODE,
+    [TCALL_CLOSURE_OPCODE] = &&op_TCALL_CLOSURE_OPCODE,
+    [CALLC_OPCODE_LOCAL] = &&op_CALLC_OPCODE_LOCAL,
+    [CALLC_OPCODE_WIDE] = &&op_CALLC_OPCODE_WIDE,
+    [CALLC_DIRECT_OPCODE_LOCAL] = &&op_CALLC_DIRECT_OPCODE_LOCAL,
+    [CALLC_DIRECT_OPCODE_WIDE] = &&op_CALLC_DIRECT_OPCODE_WIDE,
+    [POP_FRAME_OPCODE] = &&op_POP_FRAME_OPCODE,
+    [LIVE_OPCODE] = &&op_LIVE_OPCODE,
+    [ENTER_STACK_OPCODE] = &&op_ENTER_STACK_OPCODE,
+    [YIELD_OPCODE] = &&op_YIELD_OPCODE,
+    [RETURN_OPCODE] = &&op_RETURN_OPCODE,
+    [DUMP_OPCODE] = &&op_DUMP_OPCODE,
+    [INT_ADD_OPCODE] = &&op_INT_ADD_OPCODE,
+    [INT_SUB_OPCODE] = &&op_INT_SUB_OPCODE,
+    [INT_MUL_OPCODE] = &&op_INT_MUL_OPCODE,
+    [INT_DIV_OPCODE] = &&op_INT_DIV_OPCODE,
+    [INT_MOD_OPCODE] = &&op_INT_MOD_OPCODE,
+    [INT_AND_OPCODE] = &&op_INT_AND_OPCODE,
+    [INT_OR_OPCODE] = &&op_INT_OR_OPCODE,
+    [INT_XOR_OPCODE] = &&op_INT_XOR_OPCODE,
+    [INT_SHL_OPCODE] = &&op_INT_SHL_OPCODE,
+    [INT_SHR_OPCODE] = &&op_INT_SHR_OPCODE,
+    [INT_ASHR_OPCODE] = &&op_INT_ASHR_OPCODE,
+    [INT_LT_OPCODE] = &&op_INT_LT_OPCODE,
+    [INT_GT_OPCODE] = &&op_INT_GT_OPCODE,
+    [INT_LE_OPCODE] = &&op_INT_LE_OPCODE,
+    [INT_GE_OPCODE] = &&op_INT_GE_OPCODE,
+    [EQ_OPCODE_REF_REF] = &&op_EQ_OPCODE_REF_REF,
+    [EQ_OPCODE_REF] = &&op_EQ_OPCODE_REF,
+    [EQ_OPCODE_BYTE] = &&op_EQ_OPCODE_BYTE,
+    [EQ_OPCODE_INT] = &&op_EQ_OPCODE_INT,
+    [EQ_OPCODE_LONG] = &&op_EQ_OPCODE_LONG,
+    [EQ_OPCODE_FLOAT] = &&op_EQ_OPCODE_FLOAT,
+    [EQ_OPCODE_DOUBLE] = &&op_EQ_OPCODE_DOUBLE,
+    [NE_OPCODE_REF_REF] = &&op_NE_OPCODE_REF_REF,
+    [NE_OPCODE_REF] = &&op_NE_OPCODE_REF,
+    [NE_OPCODE_BYTE] = &&op_NE_OPCODE_BYTE,
+    [NE_OPCODE_INT] = &&op_NE_OPCODE_INT,
+    [NE_OPCODE_LONG] = &&op_NE_OPCODE_LONG,
+    [NE_OPCODE_FLOAT] = &&op_NE_OPCODE_FLOAT,
+    [NE_OPCODE_DOUBLE] = &&op_NE_OPCODE_DOUBLE,
+    [ADD_OPCODE_BYTE] = &&op_ADD_OPCODE_BYTE,
+    [ADD_OPCODE_INT] = &&op_ADD_OPCODE_INT,
+    [ADD_OPCODE_LONG] = &&op_ADD_OPCODE_LONG,
+    [ADD_OPCODE_FLOAT] = &&op_ADD_OPCODE_FLOAT,
+    [ADD_OPCODE_DOUBLE] = &&op_ADD_OPCODE_DOUBLE,
+    [SUB_OPCODE_BYTE] = &&op_SUB_OPCODE_BYTE,
+    [SUB_OPCODE_INT] = &&op_SUB_OPCODE_INT,
+    [SUB_OPCODE_LONG] = &&op_SUB_OPCODE_LONG,
+    [SUB_OPCODE_FLOAT] = &&op_SUB_OPCODE_FLOAT,
+    [SUB_OPCODE_DOUBLE] = &&op_SUB_OPCODE_DOUBLE,
+    [MUL_OPCODE_BYTE] = &&op_MUL_OPCODE_BYTE,
+    [MUL_OPCODE_INT] = &&op_MUL_OPCODE_INT,
+    [MUL_OPCODE_LONG] = &&op_MUL_OPCODE_LONG,
+    [MUL_OPCODE_FLOAT] = &&op_MUL_OPCODE_FLOAT,
+    [MUL_OPCODE_DOUBLE] = &&op_MUL_OPCODE_DOUBLE,
+    [DIV_OPCODE_BYTE] = &&op_DIV_OPCODE_BYTE,
+    [DIV_OPCODE_INT] = &&op_DIV_OPCODE_INT,
+    [DIV_OPCODE_LONG] = &&op_DIV_OPCODE_LONG,
+    [DIV_OPCODE_FLOAT] = &&op_DIV_OPCODE_FLOAT,
+    [DIV_OPCODE_DOUBLE] = &&op_DIV_OPCODE_DOUBLE,
+    [MOD_OPCODE_BYTE] = &&op_MOD_OPCODE_BYTE,
+    [MOD_OPCODE_INT] = &&op_MOD_OPCODE_INT,
+    [MOD_OPCODE_LONG] = &&op_MOD_OPCODE_LONG,
+    [AND_OPCODE_BYTE] = &&op_AND_OPCODE_BYTE,
+    [AND_OPCODE_INT] = &&op_AND_OPCODE_INT,
+    [AND_OPCODE_LONG] = &&op_AND_OPCODE_LONG,
+    [OR_OPCODE_BYTE] = &&op_OR_OPCODE_BYTE,
+    [OR_OPCODE_INT] = &&op_OR_OPCODE_INT,
+    [OR_OPCODE_LONG] = &&op_OR_OPCODE_LONG,
+    [XOR_OPCODE_BYTE] = &&op_XOR_OPCODE_BYTE,
+    [XOR_OPCODE_INT] = &&op_XOR_OPCODE_INT,
+    [XOR_OPCODE_LONG] = &&op_XOR_OPCODE_LONG,
+    [SHL_OPCODE_BYTE] = &&op_SHL_OPCODE_BYTE,
+    [SHL_OPCODE_INT] = &&op_SHL_OPCODE_INT,
+    [SHL_OPCODE_LONG] = &&op_SHL_OPCODE_LONG,
+    [SHR_OPCODE_BYTE] = &&op_SHR_OPCODE_BYTE,
+    [SHR_OPCODE_INT] = &&op_SHR_OPCODE_INT,
+    [SHR_OPCODE_LONG] = &&op_SHR_OPCODE_LONG,
+    [ASHR_OPCODE_INT] = &&op_ASHR_OPCODE_INT,
+    [ASHR_OPCODE_LONG] = &&op_ASHR_OPCODE_LONG,
+    [LT_OPCODE_INT] = &&op_LT_OPCODE_INT,
+    [LT_OPCODE_LONG] = &&op_LT_OPCODE_LONG,
+    [LT_OPCODE_FLOAT] = &&op_LT_OPCODE_FLOAT,
+    [LT_OPCODE_DOUBLE] = &&op_LT_OPCODE_DOUBLE,
+    [GT_OPCODE_INT] = &&op_GT_OPCODE_INT,
+    [GT_OPCODE_LONG] = &&op_GT_OPCODE_LONG,
+    [GT_OPCODE_FLOAT] = &&op_GT_OPCODE_FLOAT,
+    [GT_OPCODE_DOUBLE] = &&op_GT_OPCODE_DOUBLE,
+    [LE_OPCODE_INT] = &&op_LE_OPCODE_INT,
+    [LE_OPCODE_LONG] = &&op_LE_OPCODE_LONG,
+    [LE_OPCODE_FLOAT] = &&op_LE_OPCODE_FLOAT,
+    [LE_OPCODE_DOUBLE] = &&op_LE_OPCODE_DOUBLE,
+    [GE_OPCODE_INT] = &&op_GE_OPCODE_INT,
+    [GE_OPCODE_LONG] = &&op_GE_OPCODE_LONG,
+    [GE_OPCODE_FLOAT] = &&op_GE_OPCODE_FLOAT,
+    [GE_OPCODE_DOUBLE] = &&op_GE_OPCODE_DOUBLE,
+    [ULE_OPCODE_BYTE] = &&op_ULE_OPCODE_BYTE,
+    [ULE_OPCODE_INT] = &&op_ULE_OPCODE_INT,
+    [ULE_OPCODE_LONG] = &&op_ULE_OPCODE_LONG,
+    [ULT_OPCODE_BYTE] = &&op_ULT_OPCODE_BYTE,
+    [ULT_OPCODE_INT] = &&op_ULT_OPCODE_INT,
+    [ULT_OPCODE_LONG] = &&op_ULT_OPCODE_LONG,
+    [UGT_OPCODE_BYTE] = &&op_UGT_OPCODE_BYTE,
+    [UGT_OPCODE_INT] = &&op_UGT_OPCODE_INT,
+    [UGT_OPCODE_LONG] = &&op_UGT_OPCODE_LONG,
+    [UGE_OPCODE_BYTE] = &&op_UGE_OPCODE_BYTE,
+    [UGE_OPCODE_INT] = &&op_UGE_OPCODE_INT,
+    [UGE_OPCODE_LONG] = &&op_UGE_OPCODE_LONG,
+    [INT_NOT_OPCODE] = &&op_INT_NOT_OPCODE,
+    [INT_NEG_OPCODE] = &&op_INT_NEG_OPCODE,
+    [NOT_OPCODE_BYTE] = &&op_NOT_OPCODE_BYTE,
+    [NOT_OPCODE_INT] = &&op_NOT_OPCODE_INT,
+    [NOT_OPCODE_LONG] = &&op_NOT_OPCODE_LONG,
+    [NEG_OPCODE_INT] = &&op_NEG_OPCODE_INT,
+    [NEG_OPCODE_LONG] = &&op_NEG_OPCODE_LONG,
+    [NEG_OPCODE_FLOAT] = &&op_NEG_OPCODE_FLOAT,
+    [NEG_OPCODE_DOUBLE] = &&op_NEG_OPCODE_DOUBLE,
+    [DEREF_OPCODE] = &&op_DEREF_OPCODE,
+    [TYPEOF_OPCODE] = &&op_TYPEOF_OPCODE,
+    [JUMP_SET_OPCODE] = &&op_JUMP_SET_OPCODE,
+    [JUMP_TAGBITS_OPCODE] = &&op_JUMP_TAGBITS_OPCODE,
+    [JUMP_TAGWORD_OPCODE] = &&op_JUMP_TAGWORD_OPCODE,
+    [GOTO_OPCODE] = &&op_GOTO_OPCODE,
+    [CONV_OPCODE_BYTE_FLOAT] = &&op_CONV_OPCODE_BYTE_FLOAT,
+    [CONV_OPCODE_BYTE_DOUBLE] = &&op_CONV_OPCODE_BYTE_DOUBLE,
+    [CONV_OPCODE_INT_BYTE] = &&op_CONV_OPCODE_INT_BYTE,
+    [CONV_OPCODE_INT_FLOAT] = &&op_CONV_OPCODE_INT_FLOAT,
+    [CONV_OPCODE_INT_DOUBLE] = &&op_CONV_OPCODE_INT_DOUBLE,
+    [CONV_OPCODE_LONG_BYTE] = &&op_CONV_OPCODE_LONG_BYTE,
+    [CONV_OPCODE_LONG_INT] = &&op_CONV_OPCODE_LONG_INT,
+    [CONV_OPCODE_LONG_FLOAT] = &&op_CONV_OPCODE_LONG_FLOAT,
+    [CONV_OPCODE_LONG_DOUBLE] = &&op_CONV_OPCODE_LONG_DOUBLE,
+    [CONV_OPCODE_FLOAT_BYTE] = &&op_CONV_OPCODE_FLOAT_BYTE,
+    [CONV_OPCODE_FLOAT_INT] = &&op_CONV_OPCODE_FLOAT_INT,
+    [CONV_OPCODE_FLOAT_LONG] = &&op_CONV_OPCODE_FLOAT_LONG,
+    [CONV_OPCODE_FLOAT_DOUBLE] = &&op_CONV_OPCODE_FLOAT_DOUBLE,
+    [CONV_OPCODE_DOUBLE_BYTE] = &&op_CONV_OPCODE_DOUBLE_BYTE,
+    [CONV_OPCODE_DOUBLE_INT] = &&op_CONV_OPCODE_DOUBLE_INT,
+    [CONV_OPCODE_DOUBLE_LONG] = &&op_CONV_OPCODE_DOUBLE_LONG,
+    [CONV_OPCODE_DOUBLE_FLOAT] = &&op_CONV_OPCODE_DOUBLE_FLOAT,
+    [DETAG_OPCODE] = &&op_DETAG_OPCODE,
+    [TAG_OPCODE_BYTE] = &&op_TAG_OPCODE_BYTE,
+    [TAG_OPCODE_CHAR] = &&op_TAG_OPCODE_CHAR,
+    [TAG_OPCODE_INT] = &&op_TAG_OPCODE_INT,
+    [TAG_OPCODE_FLOAT] = &&op_TAG_OPCODE_FLOAT,
+    [STORE_OPCODE_1] = &&op_STORE_OPCODE_1,
+    [STORE_OPCODE_4] = &&op_STORE_OPCODE_4,
+    [STORE_OPCODE_8] = &&op_STORE_OPCODE_8,
+    [STORE_OPCODE_1_VAR_OFFSET] = &&op_STORE_OPCODE_1_VAR_OFFSET,
+    [STORE_OPCODE_4_VAR_OFFSET] = &&op_STORE_OPCODE_4_VAR_OFFSET,
+    [STORE_OPCODE_8_VAR_OFFSET] = &&op_STORE_OPCODE_8_VAR_OFFSET,
+    [LOAD_OPCODE_1] = &&op_LOAD_OPCODE_1,
+    [LOAD_OPCODE_4] = &&op_LOAD_OPCODE_4,
+    [LOAD_OPCODE_8] = &&op_LOAD_OPCODE_8,
+    [LOAD_OPCODE_1_VAR_OFFSET] = &&op_LOAD_OPCODE_1_VAR_OFFSET,
+    [LOAD_OPCODE_4_VAR_OFFSET] = &&op_LOAD_OPCODE_4_VAR_OFFSET,
+    [LOAD_OPCODE_8_VAR_OFFSET] = &&op_LOAD_OPCODE_8_VAR_OFFSET,
+    [RESERVE_OPCODE_LOCAL] = &&op_RESERVE_OPCODE_LOCAL,
+    [RESERVE_OPCODE_CONST] = &&op_RESERVE_OPCODE_CONST,
+    [ALLOC_OPCODE_CONST] = &&op_ALLOC_OPCODE_CONST,
+    [ALLOC_OPCODE_LOCAL] = &&op_ALLOC_OPCODE_LOCAL,
+    [GC_OPCODE] = &&op_GC_OPCODE,
+    [CLASS_NAME_OPCODE] = &&op_CLASS_NAME_OPCODE,
+    [PRINT_STACK_TRACE_OPCODE] = &&op_PRINT_STACK_TRACE_OPCODE,
+    [FLUSH_VM_OPCODE] = &&op_FLUSH_VM_OPCODE,
+    [C_RSP_OPCODE] = &&op_C_RSP_OPCODE,
+    [JUMP_INT_LT_OPCODE] = &&op_JUMP_INT_LT_OPCODE,
+    [JUMP_INT_GT_OPCODE] = &&op_JUMP_INT_GT_OPCODE,
+    [JUMP_INT_LE_OPCODE] = &&op_JUMP_INT_LE_OPCODE,
+    [JUMP_INT_GE_OPCODE] = &&op_JUMP_INT_GE_OPCODE,
+    [JUMP_EQ_OPCODE_REF] = &&op_JUMP_EQ_OPCODE_REF,
+    [JUMP_EQ_OPCODE_BYTE] = &&op_JUMP_EQ_OPCODE_BYTE,
+    [JUMP_EQ_OPCODE_INT] = &&op_JUMP_EQ_OPCODE_INT,
+    [JUMP_EQ_OPCODE_LONG] = &&op_JUMP_EQ_OPCODE_LONG,
+    [JUMP_EQ_OPCODE_FLOAT] = &&op_JUMP_EQ_OPCODE_FLOAT,
+    [JUMP_EQ_OPCODE_DOUBLE] = &&op_JUMP_EQ_OPCODE_DOUBLE,
+    [JUMP_NE_OPCODE_REF] = &&op_JUMP_NE_OPCODE_REF,
+    [JUMP_NE_OPCODE_BYTE] = &&op_JUMP_NE_OPCODE_BYTE,
+    [JUMP_NE_OPCODE_INT] = &&op_JUMP_NE_OPCODE_INT,
+    [JUMP_NE_OPCODE_LONG] = &&op_JUMP_NE_OPCODE_LONG,
+    [JUMP_NE_OPCODE_FLOAT] = &&op_JUMP_NE_OPCODE_FLOAT,
+    [JUMP_NE_OPCODE_DOUBLE] = &&op_JUMP_NE_OPCODE_DOUBLE,
+    [JUMP_LT_OPCODE_INT] = &&op_JUMP_LT_OPCODE_INT,
+    [JUMP_LT_OPCODE_LONG] = &&op_JUMP_LT_OPCODE_LONG,
+    [JUMP_LT_OPCODE_FLOAT] = &&op_JUMP_LT_OPCODE_FLOAT,
+    [JUMP_LT_OPCODE_DOUBLE] = &&op_JUMP_LT_OPCODE_DOUBLE,
+    [JUMP_GT_OPCODE_INT] = &&op_JUMP_GT_OPCODE_INT,
+    [JUMP_GT_OPCODE_LONG] = &&op_JUMP_GT_OPCODE_LONG,
+    [JUMP_GT_OPCODE_FLOAT] = &&op_JUMP_GT_OPCODE_FLOAT,
+    [JUMP_GT_OPCODE_DOUBLE] = &&op_JUMP_GT_OPCODE_DOUBLE,
+    [JUMP_LE_OPCODE_INT] = &&op_JUMP_LE_OPCODE_INT,
+    [JUMP_LE_OPCODE_LONG] = &&op_JUMP_LE_OPCODE_LONG,
+    [JUMP_LE_OPCODE_FLOAT] = &&op_JUMP_LE_OPCODE_FLOAT,
+    [JUMP_LE_OPCODE_DOUBLE] = &&op_JUMP_LE_OPCODE_DOUBLE,
+    [JUMP_GE_OPCODE_INT] = &&op_JUMP_GE_OPCODE_INT,
+    [JUMP_GE_OPCODE_LONG] = &&op_JUMP_GE_OPCODE_LONG,
+    [JUMP_GE_OPCODE_FLOAT] = &&op_JUMP_GE_OPCODE_FLOAT,
+    [JUMP_GE_OPCODE_DOUBLE] = &&op_JUMP_GE_OPCODE_DOUBLE,
+    [JUMP_ULE_OPCODE_BYTE] = &&op_JUMP_ULE_OPCODE_BYTE,
+    [JUMP_ULE_OPCODE_INT] = &&op_JUMP_ULE_OPCODE_INT,
+    [JUMP_ULE_OPCODE_LONG] = &&op_JUMP_ULE_OPCODE_LONG,
+    [JUMP_ULT_OPCODE_BYTE] = &&op_JUMP_ULT_OPCODE_BYTE,
+    [JUMP_ULT_OPCODE_INT] = &&op_JUMP_ULT_OPCODE_INT,
+    [JUMP_ULT_OPCODE_LONG] = &&op_JUMP_ULT_OPCODE_LONG,
+    [JUMP_UGE_OPCODE_BYTE] = &&op_JUMP_UGE_OPCODE_BYTE,
+    [JUMP_UGE_OPCODE_INT] = &&op_JUMP_UGE_OPCODE_INT,
+    [JUMP_UGE_OPCODE_LONG] = &&op_JUMP_UGE_OPCODE_LONG,
+    [JUMP_UGT_OPCODE_BYTE] = &&op_JUMP_UGT_OPCODE_BYTE,
+    [JUMP_UGT_OPCODE_INT] = &&op_JUMP_UGT_OPCODE_INT,
+    [JUMP_UGT_OPCODE_LONG] = &&op_JUMP_UGT_OPCODE_LONG,
+    [DISPATCH_OPCODE] = &&op_DISPATCH_OPCODE,
+    [DISPATCH_METHOD_OPCODE] = &&op_DISPATCH_METHOD_OPCODE,
+    [JUMP_REG_OPCODE] = &&op_JUMP_REG_OPCODE,
+    [FNENTRY_OPCODE] = &&op_FNENTRY_OPCODE,
+    [LAZY_ENTRY_OPCODE] = &&op_LAZY_ENTRY_OPCODE,
+  };
+  //Unused opcodes jump to op_INVALID. They are filled in here rather
+  //than by a [0 ... 255] designator, which the entries above would
+  //override.
+  static int dispatch_table_filled = 0;
+  if(!dispatch_table_filled){
+    for(int i=0; i<256; i++)
+      if(dispatch_table[i] == NULL) dispatch_table[i] = &&op_INVALID;
+    dispatch_table_filled = 1;
+  }
+  #endif
+
   //Repl Loop
   while(1){
     //icounter++;
     //int iprint = icounter >= iprint_start && icounter <= iprint_end && icounter % iprint_step == 0;
     
-    //Save pre-decode PC because jump offsets are relative to
-    //pre-decode PC.
-    char* pc0 = pc;
-    unsigned int W1 = PC_INT();
-    int opcode = W1 & 0xFF;
-
-    //uint64_t curtime = current_time_ms();
-    //if(last_opcode >= 0)
-    //  timings[last_opcode] += curtime - last_time;
-    //last_opcode = opcode;
-    //last_time = curtime;
-    
+    char* pc0;
+    unsigned int W1;
+    int opcode;
+    FETCH();
+
     switch(opcode){
-    case SET_OPCODE_LOCAL : {
-      DECODE_C();
-      SET_LOCAL(y, LOCAL(value));      
-      continue;
+    CASE(SET_OPCODE_LOCAL) : {
+      DECODE_B_UNSIGNED();
+      SET_LOCAL(x, LOCAL(value));
+      NEXT;
     }
-    case SET_OPCODE_UNSIGNED : {
+    CASE(SET_OPCODE_UNSIGNED) : {
       DECODE_C();
       SET_LOCAL(y, (uint64_t)value);      
-      continue;
+      NEXT;
     }
-    case SET_OPCODE_SIGNED : {
+    CASE(SET_OPCODE_SIGNED) : {
       DECODE_C();
       SET_LOCAL(y, (int64_t)value);      
-      continue;
+      NEXT;
     }
-    case SET_OPCODE_CODE : {
+    CASE(SET_OPCODE_CODE) : {
       DECODE_C();
       SET_LOCAL(y, value);
-      continue;
+      NEXT;
+    }
+    CASE(SET_OPCODE_SHORT) : {
+      DECODE_B_SIGNED();
+      SET_LOCAL(x, (int64_t)value);
+      NEXT;
     }
-    case SET_OPCODE_GLOBAL : {
+    CASE(SET_OPCODE_GLOBAL) : {
       DECODE_C();
       char* address = global_mem + global_offsets[value];
       SET_LOCAL(y, (uint64_t)address);
-      continue;
+      NEXT;
     }
-    case SET_OPCODE_DATA : {
+    CASE(SET_OPCODE_DATA) : {
       DECODE_C();
       char* address = data_mem + 8 * data_offsets[value];
       SET_LOCAL(y, (uint64_t)address);
-      continue;
+      NEXT;
     }
-    case SET_OPCODE_CONST : {
+    CASE(SET_OPCODE_CONST) : {
       DECODE_C();
       SET_LOCAL(y, const_table[value]);
-      continue;
+      NEXT;
     }
-    case SET_OPCODE_WIDE : {
+    CASE(SET_OPCODE_WIDE) : {
       DECODE_D();
       SET_LOCAL(x, value);      
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_LOCAL : {
-      DECODE_C();
-      SET_REG(y, LOCAL(value));
-      continue;
+    CASE(SET_REG_OPCODE_LOCAL) : {
+      DECODE_B_UNSIGNED();
+      SET_REG(x, LOCAL(value));
+      NEXT;
     }
-    case SET_REG_OPCODE_UNSIGNED : {
+    CASE(SET_REG_OPCODE_UNSIGNED) : {
       DECODE_C();
       SET_REG(y, (uint64_t)value);   
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_SIGNED : {
+    CASE(SET_REG_OPCODE_SIGNED) : {
       DECODE_C();
       SET_REG(y, (int64_t)value); 
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_CODE : {
+    CASE(SET_REG_OPCODE_CODE) : {
       DECODE_C();
       SET_REG(y, value);
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_GLOBAL : {
+    CASE(SET_REG_OPCODE_SHORT) : {
+      DECODE_B_SIGNED();
+      SET_REG(x, (int64_t)value);
+      NEXT;
+    }
+    CASE(SET_REG_OPCODE_GLOBAL) : {
       DECODE_C();
       char* address = global_mem + global_offsets[value];
       SET_REG(y, (uint64_t)address);
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_DATA : {
+    CASE(SET_REG_OPCODE_DATA) : {
       DECODE_C();
       char* address = data_mem + 8 * data_offsets[value];
       SET_REG(y, (uint64_t)address);
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_CONST : {
+    CASE(SET_REG_OPCODE_CONST) : {
       DECODE_C();
       SET_REG(y, const_table[value]);
-      continue;
+      NEXT;
     }
-    case SET_REG_OPCODE_WIDE : {
+    CASE(SET_REG_OPCODE_WIDE) : {
       DECODE_D();
       SET_REG(x, value);      
-      continue;
+      NEXT;
     }
-    case GET_REG_OPCODE : {
+    CASE(GET_REG_OPCODE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, registers[value]);
-      continue;
+      NEXT;
     }
-    case CALL_OPCODE_LOCAL : {
+    CASE(CALL_OPCODE_LOCAL) : {
       DECODE_C();
       int num_locals = y;
       uint64_t fid = LOCAL(value);
       uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;
+      PROFILE_CALL(fid);
+      COUNT_ENTRY(fid);
       PUSH_FRAME(num_locals);
       pc = instructions + fpos;
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case CALL_OPCODE_CODE : {
+    CASE(CALL_OPCODE_CODE) : {
       DECODE_C();
       int num_locals = y;
       uint64_t fid = value;
       uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;      
+      PROFILE_CALL(fid);
+      COUNT_ENTRY(fid);
       PUSH_FRAME(num_locals);
       pc = instructions + fpos;
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case CALL_CLOSURE_OPCODE : {
+    CASE(CALL_CLOSURE_OPCODE) : {
       DECODE_C();
       int num_locals = y;
       Function* clo = (Function*)(LOCAL(value) - REF_TAG_BITS + 8);
       uint64_t fid = clo->code;
       uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;
+      PROFILE_CALL(fid);
+      COUNT_ENTRY(fid);
       PUSH_FRAME(num_locals);
       pc = instructions + fpos;
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case TCALL_OPCODE_LOCAL : {
+    CASE(TCALL_OPCODE_LOCAL) : {
       DECODE_C();
       int num_locals = y;
       uint64_t fid = LOCAL(value);
       uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;
+      PROFILE_CALL(fid);
+      COUNT_ENTRY(fid);
       pc = instructions + fpos;
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case TCALL_OPCODE_CODE : {
+    CASE(TCALL_OPCODE_CODE) : {
       DECODE_C();
       int num_locals = y;
       uint64_t fid = value;
       uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;      
+      PROFILE_CALL(fid);
+      COUNT_ENTRY(fid);
       pc = instructions + fpos;
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case TCALL_CLOSURE_OPCODE : {
+    CASE(TCALL_CLOSURE_OPCODE) : {
       DECODE_A_UNSIGNED();
       Function* clo = (Function*)(LOCAL(value) - REF_TAG_BITS + 8);
       uint64_t fid = clo->code;
       uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;
+      PROFILE_CALL(fid);
+      COUNT_ENTRY(fid);
       pc = instructions + fpos;
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case CALLC_OPCODE_LOCAL : {
+    CASE(CALLC_OPCODE_LOCAL) : {
       DECODE_C();
       void* faddr = (void*)LOCAL(value);
       int num_locals = y;
@@ -674,11 +1838,12 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       SAVE_STATE();
       c_trampoline(faddr, registers, registers);      
       RESTORE_STATE();
+      RELOAD_CODE();
       pc = instructions + stack_pointer->returnpc;      
       POP_FRAME(num_locals);
-      continue;
+      NEXT;
     }
-    case CALLC_OPCODE_WIDE : {
+    CASE(CALLC_OPCODE_WIDE) : {
       DECODE_D();
       void* faddr = (void*)value;
       int num_locals = x;
@@ -686,22 +1851,49 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       SAVE_STATE();
       c_trampoline(faddr, registers, registers);      
       RESTORE_STATE();
+      RELOAD_CODE();
       pc = instructions + stack_pointer->returnpc;      
       POP_FRAME(num_locals);
-      continue;
+      NEXT;
+    }
+    CASE(CALLC_DIRECT_OPCODE_LOCAL) : {
+      DECODE_C();
+      void* faddr = (void*)LOCAL(value);
+      int num_locals = y;
+      PUSH_FRAME(num_locals);
+      SAVE_STATE();
+      direct_callc(faddr, registers);
+      RESTORE_STATE();
+      RELOAD_CODE();
+      pc = instructions + stack_pointer->returnpc;
+      POP_FRAME(num_locals);
+      NEXT;
     }
-    case POP_FRAME_OPCODE : {
+    CASE(CALLC_DIRECT_OPCODE_WIDE) : {
+      DECODE_D();
+      void* faddr = (void*)value;
+      int num_locals = x;
+      PUSH_FRAME(num_locals);
+      SAVE_STATE();
+      direct_callc(faddr, registers);
+      RESTORE_STATE();
+      RELOAD_CODE();
+      pc = instructions + stack_pointer->returnpc;
+      POP_FRAME(num_locals);
+      NEXT;
+    }
+    CASE(POP_FRAME_OPCODE) : {
       DECODE_A_UNSIGNED();
       int num_locals = value;
       POP_FRAME(num_locals);
-      continue;
+      NEXT;
     }
-    case LIVE_OPCODE : {
+    CASE(LIVE_OPCODE) : {
       DECODE_A_UNSIGNED();
       stack_pointer->liveness_map = value;
-      continue;
+      NEXT;
     }
-    case ENTER_STACK_OPCODE : {
+    CASE(ENTER_STACK_OPCODE) : {
       DECODE_A_UNSIGNED();
       //Save current stack
       stk->stack_pointer = stack_pointer;
@@ -715,9 +1907,9 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       uint64_t fid = stk->pc;
       uint64_t stk_pc = code_offsets[fid] * 4;
       pc = instructions + stk_pc;
-      continue;
+      NEXT;
     }
-    case YIELD_OPCODE : {
+    CASE(YIELD_OPCODE) : {
       DECODE_A_UNSIGNED();
       //Save current stack
       stk->stack_pointer = stack_pointer;
@@ -728,9 +1920,9 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       stack_pointer = stk->stack_pointer;
       stack_limit = (char*)(stk->frames) + stk->size;
       pc = instructions + stk->pc;
-      continue;
+      NEXT;
     }
-    case RETURN_OPCODE : {
+    CASE(RETURN_OPCODE) : {
       DECODE_A_UNSIGNED();
       int64_t retpc = stack_pointer->returnpc;
       if(retpc == SYSTEM_RETURN_STUB){
@@ -751,7 +1943,7 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
         retpc = stk->pc;
         
         pc = instructions + retpc;
-        continue;        
+        NEXT;        
       }      
       else if(retpc < 0){
         //Save registers
@@ -762,10 +1954,10 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       }
       else{
         pc = instructions + retpc;
-        continue;
+        NEXT;
       }
     }
-    case DUMP_OPCODE : {
+    CASE(DUMP_OPCODE) : {
       DECODE_A_UNSIGNED();
       int64_t xl = (int64_t)LOCAL(value);
       char xb = (char)xl;
@@ -774,574 +1966,574 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       float xd = LOCAL_DOUBLE(value);
       printf("DUMP LOCAL %d: (byte = %d, int = %d, long = %" PRId64 ", ptr = %p, float = %f, double = %f)\n",
              value, xb, xi, xl, (void*)xl, xf, xd);
-      continue;
+      NEXT;
     }
-    case INT_ADD_OPCODE : {
+    CASE(INT_ADD_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) + (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_SUB_OPCODE : {
+    CASE(INT_SUB_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) - (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_MUL_OPCODE : {
+    CASE(INT_MUL_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, ((int64_t)(LOCAL(y)) >> 32L) * (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_DIV_OPCODE : {
+    CASE(INT_DIV_OPCODE) : {
       DECODE_C();
       int64_t sy = (int64_t)LOCAL(y);
       int64_t sz = (int64_t)LOCAL(value);
       SET_LOCAL(x, (sy / sz) << 32L);
-      continue;
+      NEXT;
     }
-    case INT_MOD_OPCODE : {
+    CASE(INT_MOD_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) % (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_AND_OPCODE : {
+    CASE(INT_AND_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) & (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_OR_OPCODE : {
+    CASE(INT_OR_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) | (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_XOR_OPCODE : {
+    CASE(INT_XOR_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) ^ (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case INT_SHL_OPCODE : {
+    CASE(INT_SHL_OPCODE) : {
       DECODE_C();
       int64_t sy = (int64_t)LOCAL(y);
       int64_t sz = (int64_t)LOCAL(value);
       SET_LOCAL(x, sy << (sz >> 32L));
-      continue;
+      NEXT;
     }
-    case INT_SHR_OPCODE : {
+    CASE(INT_SHR_OPCODE) : {
       DECODE_C();
       uint64_t uy = LOCAL(y);
       int64_t sz = (int64_t)LOCAL(value);
       uint64_t r = uy >> (sz >> 32L);
       SET_LOCAL(x, (r >> 32L) << 32L);
-      continue;
+      NEXT;
     }
-    case INT_ASHR_OPCODE : {
+    CASE(INT_ASHR_OPCODE) : {
       DECODE_C();
       int64_t sy = (int64_t)LOCAL(y);
       int64_t sz = (int64_t)LOCAL(value);
       uint64_t r = sy >> (sz >> 32L);
       SET_LOCAL(x, (r >> 32L) << 32L);
-      continue;
+      NEXT;
     }
-    case INT_LT_OPCODE : {
+    CASE(INT_LT_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, BOOLREF((int64_t)(LOCAL(y)) < (int64_t)(LOCAL(value))));
-      continue;
+      NEXT;
     }
-    case INT_GT_OPCODE : {
+    CASE(INT_GT_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, BOOLREF((int64_t)(LOCAL(y)) > (int64_t)(LOCAL(value))));
-      continue;
+      NEXT;
     }
-    case INT_LE_OPCODE : {
+    CASE(INT_LE_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, BOOLREF((int64_t)(LOCAL(y)) <= (int64_t)(LOCAL(value))));
-      continue;
+      NEXT;
     }
-    case INT_GE_OPCODE : {
+    CASE(INT_GE_OPCODE) : {
       DECODE_C();
       SET_LOCAL(x, BOOLREF((int64_t)(LOCAL(y)) >= (int64_t)(LOCAL(value))));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_REF_REF : {
+    CASE(EQ_OPCODE_REF_REF) : {
       DECODE_C();
       SET_LOCAL(x, BOOLREF(LOCAL(y) == LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_REF : {
+    CASE(EQ_OPCODE_REF) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL(y) == LOCAL(value));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_BYTE : {
+    CASE(EQ_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (uint8_t)LOCAL(y) == (uint8_t)LOCAL(value));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_INT : {
+    CASE(EQ_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)LOCAL(y) == (int32_t)LOCAL(value));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_LONG : {
+    CASE(EQ_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)LOCAL(y) == (int64_t)LOCAL(value));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_FLOAT : {
+    CASE(EQ_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_FLOAT(y) == LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case EQ_OPCODE_DOUBLE : {
+    CASE(EQ_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_DOUBLE(y) == LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_REF_REF : {
+    CASE(NE_OPCODE_REF_REF) : {
       DECODE_C();
       SET_LOCAL(x, BOOLREF(LOCAL(y) != LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_REF : {
+    CASE(NE_OPCODE_REF) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL(y) != LOCAL(value));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_BYTE : {
+    CASE(NE_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (uint8_t)LOCAL(y) != (uint8_t)LOCAL(value));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_INT : {
+    CASE(NE_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)LOCAL(y) != (int32_t)LOCAL(value));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_LONG : {
+    CASE(NE_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)LOCAL(y) != (int64_t)LOCAL(value));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_FLOAT : {
+    CASE(NE_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_FLOAT(y) != LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case NE_OPCODE_DOUBLE : {
+    CASE(NE_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_DOUBLE(y) != LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case ADD_OPCODE_BYTE : {
+    CASE(ADD_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) + (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ADD_OPCODE_INT : {
+    CASE(ADD_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) + (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ADD_OPCODE_LONG : {
+    CASE(ADD_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) + (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ADD_OPCODE_FLOAT : {
+    CASE(ADD_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL_FLOAT(x, LOCAL_FLOAT(y) + LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case ADD_OPCODE_DOUBLE : {
+    CASE(ADD_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL_DOUBLE(x, LOCAL_DOUBLE(y) + LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case SUB_OPCODE_BYTE : {
+    CASE(SUB_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) - (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SUB_OPCODE_INT : {
+    CASE(SUB_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) - (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SUB_OPCODE_LONG : {
+    CASE(SUB_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) - (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SUB_OPCODE_FLOAT : {
+    CASE(SUB_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL_FLOAT(x, LOCAL_FLOAT(y) - LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case SUB_OPCODE_DOUBLE : {
+    CASE(SUB_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL_DOUBLE(x, LOCAL_DOUBLE(y) - LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case MUL_OPCODE_BYTE : {
+    CASE(MUL_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) * (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case MUL_OPCODE_INT : {
+    CASE(MUL_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) * (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case MUL_OPCODE_LONG : {
+    CASE(MUL_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) * (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case MUL_OPCODE_FLOAT : {
+    CASE(MUL_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL_FLOAT(x, LOCAL_FLOAT(y) * LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case MUL_OPCODE_DOUBLE : {
+    CASE(MUL_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL_DOUBLE(x, LOCAL_DOUBLE(y) * LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }      
-    case DIV_OPCODE_BYTE : {
+    CASE(DIV_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) / (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case DIV_OPCODE_INT : {
+    CASE(DIV_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) / (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case DIV_OPCODE_LONG : {
+    CASE(DIV_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) / (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case DIV_OPCODE_FLOAT : {
+    CASE(DIV_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL_FLOAT(x, LOCAL_FLOAT(y) / LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case DIV_OPCODE_DOUBLE : {
+    CASE(DIV_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL_DOUBLE(x, LOCAL_DOUBLE(y) / LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }            
-    case MOD_OPCODE_BYTE : {
+    CASE(MOD_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) % (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case MOD_OPCODE_INT : {
+    CASE(MOD_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) % (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case MOD_OPCODE_LONG : {
+    CASE(MOD_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) % (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case AND_OPCODE_BYTE : {
+    CASE(AND_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) & (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case AND_OPCODE_INT : {
+    CASE(AND_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) & (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case AND_OPCODE_LONG : {
+    CASE(AND_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) & (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case OR_OPCODE_BYTE : {
+    CASE(OR_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) | (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case OR_OPCODE_INT : {
+    CASE(OR_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) | (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case OR_OPCODE_LONG : {
+    CASE(OR_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) | (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case XOR_OPCODE_BYTE : {
+    CASE(XOR_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) ^ (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case XOR_OPCODE_INT : {
+    CASE(XOR_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) ^ (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case XOR_OPCODE_LONG : {
+    CASE(XOR_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) ^ (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SHL_OPCODE_BYTE : {
+    CASE(SHL_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (char)(LOCAL(y)) << (char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SHL_OPCODE_INT : {
+    CASE(SHL_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) << (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SHL_OPCODE_LONG : {
+    CASE(SHL_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) << (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SHR_OPCODE_BYTE : {
+    CASE(SHR_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (unsigned char)(LOCAL(y)) >> (unsigned char)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SHR_OPCODE_INT : {
+    CASE(SHR_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (uint32_t)(LOCAL(y)) >> (uint32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case SHR_OPCODE_LONG : {
+    CASE(SHR_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (uint64_t)(LOCAL(y)) >> (uint64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ASHR_OPCODE_INT : {
+    CASE(ASHR_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) >> (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ASHR_OPCODE_LONG : {
+    CASE(ASHR_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) >> (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case LT_OPCODE_INT : {
+    CASE(LT_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) < (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case LT_OPCODE_LONG : {
+    CASE(LT_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) < (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case LT_OPCODE_FLOAT : {
+    CASE(LT_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_FLOAT(y) < LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case LT_OPCODE_DOUBLE : {
+    CASE(LT_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_DOUBLE(y) < LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case GT_OPCODE_INT : {
+    CASE(GT_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) > (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case GT_OPCODE_LONG : {
+    CASE(GT_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) > (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case GT_OPCODE_FLOAT : {
+    CASE(GT_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_FLOAT(y) > LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case GT_OPCODE_DOUBLE : {
+    CASE(GT_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_DOUBLE(y) > LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case LE_OPCODE_INT : {
+    CASE(LE_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) <= (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case LE_OPCODE_LONG : {
+    CASE(LE_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) <= (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case LE_OPCODE_FLOAT : {
+    CASE(LE_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_FLOAT(y) <= LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case LE_OPCODE_DOUBLE : {
+    CASE(LE_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_DOUBLE(y) <= LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case GE_OPCODE_INT : {
+    CASE(GE_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (int32_t)(LOCAL(y)) >= (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case GE_OPCODE_LONG : {
+    CASE(GE_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (int64_t)(LOCAL(y)) >= (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case GE_OPCODE_FLOAT : {
+    CASE(GE_OPCODE_FLOAT) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_FLOAT(y) >= LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case GE_OPCODE_DOUBLE : {
+    CASE(GE_OPCODE_DOUBLE) : {
       DECODE_C();
       SET_LOCAL(x, LOCAL_DOUBLE(y) >= LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
 
-    case ULE_OPCODE_BYTE : {
+    CASE(ULE_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (uint8_t)(LOCAL(y)) <= (uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ULE_OPCODE_INT : {
+    CASE(ULE_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (uint32_t)(LOCAL(y)) <= (uint32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ULE_OPCODE_LONG : {
+    CASE(ULE_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (uint64_t)(LOCAL(y)) <= (uint64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ULT_OPCODE_BYTE : {
+    CASE(ULT_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (uint8_t)(LOCAL(y)) < (uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ULT_OPCODE_INT : {
+    CASE(ULT_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (uint32_t)(LOCAL(y)) < (uint32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case ULT_OPCODE_LONG : {
+    CASE(ULT_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (uint64_t)(LOCAL(y)) < (uint64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case UGT_OPCODE_BYTE : {
+    CASE(UGT_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (uint8_t)(LOCAL(y)) > (uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case UGT_OPCODE_INT : {
+    CASE(UGT_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (uint32_t)(LOCAL(y)) > (uint32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case UGT_OPCODE_LONG : {
+    CASE(UGT_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (uint64_t)(LOCAL(y)) > (uint64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case UGE_OPCODE_BYTE : {
+    CASE(UGE_OPCODE_BYTE) : {
       DECODE_C();
       SET_LOCAL(x, (uint8_t)(LOCAL(y)) >= (uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case UGE_OPCODE_INT : {
+    CASE(UGE_OPCODE_INT) : {
       DECODE_C();
       SET_LOCAL(x, (uint32_t)(LOCAL(y)) >= (uint32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case UGE_OPCODE_LONG : {
+    CASE(UGE_OPCODE_LONG) : {
       DECODE_C();
       SET_LOCAL(x, (uint64_t)(LOCAL(y)) >= (uint64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }      
-    case INT_NOT_OPCODE : {
+    CASE(INT_NOT_OPCODE) : {
       DECODE_B_UNSIGNED();
       uint64_t y = LOCAL(value);
       SET_LOCAL(x, ((~ y) >> 32L) << 32L);
-      continue;
+      NEXT;
     }
-    case INT_NEG_OPCODE : {
+    CASE(INT_NEG_OPCODE) : {
       DECODE_B_UNSIGNED();
       int64_t y = LOCAL(value);
       SET_LOCAL(x, - y);
-      continue;
+      NEXT;
     }      
-    case NOT_OPCODE_BYTE : {
+    CASE(NOT_OPCODE_BYTE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ~ ((uint8_t)LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case NOT_OPCODE_INT : {
+    CASE(NOT_OPCODE_INT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ~ ((uint32_t)LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case NOT_OPCODE_LONG : {
+    CASE(NOT_OPCODE_LONG) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ~ ((uint64_t)LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case NEG_OPCODE_INT : {
+    CASE(NEG_OPCODE_INT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, - ((int32_t)LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case NEG_OPCODE_LONG : {
+    CASE(NEG_OPCODE_LONG) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, - ((int64_t)LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case NEG_OPCODE_FLOAT : {
+    CASE(NEG_OPCODE_FLOAT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_FLOAT(x, - LOCAL_FLOAT(value));      
-      continue;
+      NEXT;
     }
-    case NEG_OPCODE_DOUBLE : {
+    CASE(NEG_OPCODE_DOUBLE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_DOUBLE(x, - LOCAL_DOUBLE(value));      
-      continue;
+      NEXT;
     }
-    case DEREF_OPCODE : {
+    CASE(DEREF_OPCODE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, LOCAL(value) + 8 - REF_TAG_BITS);
-      continue;
+      NEXT;
     }
-    case TYPEOF_OPCODE : {
+    CASE(TYPEOF_OPCODE) : {
       DECODE_C();
       int format = value;
       int index = read_dispatch_table(vms, format);
       SET_LOCAL(x, index);
-      continue;
+      NEXT;
     }
-    case JUMP_SET_OPCODE : {
+    CASE(JUMP_SET_OPCODE) : {
       DECODE_F();
       F_JUMP(LOCAL(x));
     }
-    case JUMP_TAGBITS_OPCODE : {
+    CASE(JUMP_TAGBITS_OPCODE) : {
       DECODE_F();
       int tagbits = (int)(LOCAL(x)) & 0x7;
       int bits = y;
       F_JUMP(tagbits == bits);
     }
-    case JUMP_TAGWORD_OPCODE : {
+    CASE(JUMP_TAGWORD_OPCODE) : {
       DECODE_F();
       uint64_t obj = LOCAL(x);
       int tagbits = (int)obj & 0x7;
@@ -1351,203 +2543,204 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
         F_JUMP(*p == tag);
       }else{
         pc = pc0 + (n2 * 4);
-        continue;
+        NEXT;
       }
     }
-    case GOTO_OPCODE : {
+    CASE(GOTO_OPCODE) : {
       DECODE_A_SIGNED();
       pc = pc0 + (value * 4);
-      continue;
+      CHECK_SAMPLE();
+      NEXT;
     }
-    case CONV_OPCODE_BYTE_FLOAT : {
+    CASE(CONV_OPCODE_BYTE_FLOAT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (uint8_t)(LOCAL_FLOAT(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_BYTE_DOUBLE : {
+    CASE(CONV_OPCODE_BYTE_DOUBLE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (uint8_t)(LOCAL_DOUBLE(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_INT_BYTE : {
+    CASE(CONV_OPCODE_INT_BYTE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int32_t)(uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_INT_FLOAT : {
+    CASE(CONV_OPCODE_INT_FLOAT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int32_t)(LOCAL_FLOAT(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_INT_DOUBLE : {
+    CASE(CONV_OPCODE_INT_DOUBLE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int32_t)(LOCAL_DOUBLE(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_LONG_BYTE : {
+    CASE(CONV_OPCODE_LONG_BYTE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int64_t)(uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_LONG_INT : {
+    CASE(CONV_OPCODE_LONG_INT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int64_t)(int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_LONG_FLOAT : {
+    CASE(CONV_OPCODE_LONG_FLOAT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int64_t)(LOCAL_FLOAT(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_LONG_DOUBLE : {
+    CASE(CONV_OPCODE_LONG_DOUBLE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, (int64_t)(LOCAL_DOUBLE(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_FLOAT_BYTE : {
+    CASE(CONV_OPCODE_FLOAT_BYTE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_FLOAT(x, (uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_FLOAT_INT : {
+    CASE(CONV_OPCODE_FLOAT_INT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_FLOAT(x, (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_FLOAT_LONG : {
+    CASE(CONV_OPCODE_FLOAT_LONG) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_FLOAT(x, (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_FLOAT_DOUBLE : {
+    CASE(CONV_OPCODE_FLOAT_DOUBLE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_FLOAT(x, LOCAL_DOUBLE(value));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_DOUBLE_BYTE : {
+    CASE(CONV_OPCODE_DOUBLE_BYTE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_DOUBLE(x, (uint8_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_DOUBLE_INT : {
+    CASE(CONV_OPCODE_DOUBLE_INT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_DOUBLE(x, (int32_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_DOUBLE_LONG : {
+    CASE(CONV_OPCODE_DOUBLE_LONG) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_DOUBLE(x, (int64_t)(LOCAL(value)));
-      continue;
+      NEXT;
     }
-    case CONV_OPCODE_DOUBLE_FLOAT : {
+    CASE(CONV_OPCODE_DOUBLE_FLOAT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL_DOUBLE(x, LOCAL_FLOAT(value));
-      continue;
+      NEXT;
     }
-    case DETAG_OPCODE : {
+    CASE(DETAG_OPCODE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, LOCAL(value) >> 32L);
-      continue;
+      NEXT;
     }
-    case TAG_OPCODE_BYTE : {
+    CASE(TAG_OPCODE_BYTE) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ((uint64_t)(uint8_t)(LOCAL(value)) << 32L) + BYTE_TAG_BITS);
-      continue;
+      NEXT;
     }
-    case TAG_OPCODE_CHAR : {
+    CASE(TAG_OPCODE_CHAR) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ((uint64_t)(uint8_t)(LOCAL(value)) << 32L) + CHAR_TAG_BITS);
-      continue;
+      NEXT;
     }
-    case TAG_OPCODE_INT : {
+    CASE(TAG_OPCODE_INT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ((uint64_t)LOCAL(value) << 32L) + INT_TAG_BITS);
-      continue;
+      NEXT;
     }
-    case TAG_OPCODE_FLOAT : {
+    CASE(TAG_OPCODE_FLOAT) : {
       DECODE_B_UNSIGNED();
       SET_LOCAL(x, ((uint64_t)LOCAL(value) << 32L) + FLOAT_TAG_BITS);
-      continue;
+      NEXT;
     }
-    case STORE_OPCODE_1 : {
+    CASE(STORE_OPCODE_1) : {
       DECODE_E();
       char* address = (char*)(LOCAL(x) + value);
       char storeval = (char)(LOCAL(z));
       *address = storeval;
-      continue;
+      NEXT;
     }
-    case STORE_OPCODE_4 : {
+    CASE(STORE_OPCODE_4) : {
       DECODE_E();
       int32_t* address = (int32_t*)(LOCAL(x) + value);
       int32_t storeval = (int32_t)(LOCAL(z));
       *address = storeval;     
-      continue;
+      NEXT;
     }
-    case STORE_OPCODE_8 : {
+    CASE(STORE_OPCODE_8) : {
       DECODE_E();
       int64_t* address = (int64_t*)(LOCAL(x) + value);
       int64_t storeval = (int64_t)(LOCAL(z));
       *address = storeval;     
-      continue;
+      NEXT;
     }
-    case STORE_OPCODE_1_VAR_OFFSET : {
+    CASE(STORE_OPCODE_1_VAR_OFFSET) : {
       DECODE_E();
       char* address = (char*)(LOCAL(x) + LOCAL(y) + value);
       char storeval = (char)(LOCAL(z));
       *address = storeval;
-      continue;
+      NEXT;
     }
-    case STORE_OPCODE_4_VAR_OFFSET : {
+    CASE(STORE_OPCODE_4_VAR_OFFSET) : {
       DECODE_E();
       int32_t* address = (int32_t*)(LOCAL(x) + LOCAL(y) + value);
       int32_t storeval = (int32_t)(LOCAL(z));
       *address = storeval;
-      continue;
+      NEXT;
     }
-    case STORE_OPCODE_8_VAR_OFFSET : {
+    CASE(STORE_OPCODE_8_VAR_OFFSET) : {
       DECODE_E();
       int64_t* address = (int64_t*)(LOCAL(x) + LOCAL(y) + value);
       int64_t storeval = (int64_t)(LOCAL(z));
       *address = storeval;     
-      continue;
+      NEXT;
     }
-    case LOAD_OPCODE_1 : {
+    CASE(LOAD_OPCODE_1) : {
       DECODE_E();
       char* address = (char*)(LOCAL(y) + value);
       SET_LOCAL(x, *address);
-      continue;
+      NEXT;
     }
-    case LOAD_OPCODE_4 : {
+    CASE(LOAD_OPCODE_4) : {
       DECODE_E();
       int32_t* address = (int32_t*)(LOCAL(y) + value);
       SET_LOCAL(x, *address);
-      continue;
+      NEXT;
     }
-    case LOAD_OPCODE_8 : {
+    CASE(LOAD_OPCODE_8) : {
       DECODE_E();
       int64_t* address = (int64_t*)(LOCAL(y) + value);
       SET_LOCAL(x, *address);
-      continue;
+      NEXT;
     }
-    case LOAD_OPCODE_1_VAR_OFFSET : {
+    CASE(LOAD_OPCODE_1_VAR_OFFSET) : {
       DECODE_E();
       char* address = (char*)(LOCAL(y) + LOCAL(z) + value);
       SET_LOCAL(x, *address);
-      continue;
+      NEXT;
     }
-    case LOAD_OPCODE_4_VAR_OFFSET : {
+    CASE(LOAD_OPCODE_4_VAR_OFFSET) : {
       DECODE_E();
       int32_t* address = (int32_t*)(LOCAL(y) + LOCAL(z) + value);
       SET_LOCAL(x, *address);
-      continue;
+      NEXT;
     }
-    case LOAD_OPCODE_8_VAR_OFFSET : {
+    CASE(LOAD_OPCODE_8_VAR_OFFSET) : {
       DECODE_E();
       int64_t* address = (int64_t*)(LOCAL(y) + LOCAL(z) + value);
       SET_LOCAL(x, *address);
-      continue;
+      NEXT;
     }
-    case RESERVE_OPCODE_LOCAL : {
+    CASE(RESERVE_OPCODE_LOCAL) : {
       DECODE_C();
       uint64_t size = 8 + LOCAL(value);
       size = (size + 7) & -8;
@@ -1555,7 +2748,7 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       int offset = x * 4;
       if(heap_top + size <= heap_limit){
         pc = pc0 + offset;
-        continue;
+        NEXT;
       }else{
         SET_REG(0, BOOLREF(0));
         SET_REG(1, 1L);
@@ -1563,17 +2756,17 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
         uint64_t fpos = (uint64_t)(code_offsets[EXTEND_HEAP_FN]) * 4;
         PUSH_FRAME(num_locals);
         pc = instructions + fpos;
-        continue;
+        NEXT;
       }
     }
-    case RESERVE_OPCODE_CONST : {
+    CASE(RESERVE_OPCODE_CONST) : {
       DECODE_C();
       uint64_t size = value;
       int num_locals = y;
       int offset = x * 4;
       if(heap_top + size <= heap_limit){
         pc = pc0 + offset;
-        continue;
+        NEXT;
       }else{
         SET_REG(0, BOOLREF(0));
         SET_REG(1, 1L);
@@ -1581,10 +2774,10 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
         uint64_t fpos = (uint64_t)(code_offsets[EXTEND_HEAP_FN]) * 4;
         PUSH_FRAME(num_locals);
         pc = instructions + fpos;
-        continue;
+        NEXT;
       }
     }
-    case ALLOC_OPCODE_CONST : {
+    CASE(ALLOC_OPCODE_CONST) : {
       DECODE_C();
       int num_bytes = 8 + y;
       int type = value;
@@ -1592,9 +2785,10 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       uint64_t obj = ptr_to_ref(heap_top);
       SET_LOCAL(x, obj);
       heap_top = heap_top + num_bytes;
-      continue;
+      SAMPLE_ALLOC(type, num_bytes);
+      NEXT;
     }
-    case ALLOC_OPCODE_LOCAL : {
+    CASE(ALLOC_OPCODE_LOCAL) : {
       DECODE_C();
       uint64_t num_bytes = 8 + LOCAL(y);
       num_bytes = (num_bytes + 7) & -8;
@@ -1603,9 +2797,10 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       uint64_t obj = ptr_to_ref(heap_top);
       SET_LOCAL(x, obj);
       heap_top = heap_top + num_bytes;
-      continue;
+      SAMPLE_ALLOC(type, num_bytes);
+      NEXT;
     }
-    case GC_OPCODE : {
+    CASE(GC_OPCODE) : {
       DECODE_B_UNSIGNED();
       //Size to extend
       uint64_t size = LOCAL(value);
@@ -1615,249 +2810,253 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
       RESTORE_STATE();
       //Return heap remaining
       SET_LOCAL(x, remaining);
-      continue;
+      NEXT;
     }
-    case CLASS_NAME_OPCODE : {
+    CASE(CLASS_NAME_OPCODE) : {
       DECODE_B_UNSIGNED();
       long id = (long)LOCAL(value);
       char* name = retrieve_class_name(vms, id);
       SET_LOCAL(x, (uint64_t)name);
-      continue;
+      NEXT;
     }
-    case PRINT_STACK_TRACE_OPCODE : {
+    CASE(PRINT_STACK_TRACE_OPCODE) : {
       DECODE_B_UNSIGNED();
       uint64_t stack = LOCAL(value);
+      if(vms->trace != NULL) print_vm_trace(stderr, vms->trace);
       call_print_stack_trace(vms, stack);
       SET_REG(x, 0);
-      continue;
+      NEXT;
     }
-    case FLUSH_VM_OPCODE : {
+    CASE(FLUSH_VM_OPCODE) : {
       DECODE_A_UNSIGNED();
       SAVE_STATE();
       SET_LOCAL(value, (uint64_t)vms);
-      continue;
+      NEXT;
     }
-    case C_RSP_OPCODE : {
+    CASE(C_RSP_OPCODE) : {
       DECODE_A_UNSIGNED();
       SET_LOCAL(value, stanza_crsp);
-      continue;
+      NEXT;
     }
-    case JUMP_INT_LT_OPCODE : {
+    CASE(JUMP_INT_LT_OPCODE) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) < (int64_t)LOCAL(y));
     }
-    case JUMP_INT_GT_OPCODE : {
+    CASE(JUMP_INT_GT_OPCODE) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) > (int64_t)LOCAL(y));
     }
-    case JUMP_INT_LE_OPCODE : {
+    CASE(JUMP_INT_LE_OPCODE) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) <= (int64_t)LOCAL(y));
     }
-    case JUMP_INT_GE_OPCODE : {
+    CASE(JUMP_INT_GE_OPCODE) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) >= (int64_t)LOCAL(y));
     }      
-    case JUMP_EQ_OPCODE_REF : {
+    CASE(JUMP_EQ_OPCODE_REF) : {
       DECODE_F();      
       F_JUMP(LOCAL(x) == LOCAL(y));
     }
-    case JUMP_EQ_OPCODE_BYTE : {
+    CASE(JUMP_EQ_OPCODE_BYTE) : {
       DECODE_F();
       F_JUMP((int8_t)LOCAL(x) == (int8_t)LOCAL(y));
     }
-    case JUMP_EQ_OPCODE_INT : {
+    CASE(JUMP_EQ_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((int32_t)LOCAL(x) == (int32_t)LOCAL(y));
     }
-    case JUMP_EQ_OPCODE_LONG : {
+    CASE(JUMP_EQ_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) == (int64_t)LOCAL(y));
     }
-    case JUMP_EQ_OPCODE_FLOAT : {
+    CASE(JUMP_EQ_OPCODE_FLOAT) : {
       DECODE_F();
       F_JUMP(LOCAL_FLOAT(x) == LOCAL_FLOAT(y));
     }
-    case JUMP_EQ_OPCODE_DOUBLE : {
+    CASE(JUMP_EQ_OPCODE_DOUBLE) : {
       DECODE_F();
       F_JUMP(LOCAL_DOUBLE(x) == LOCAL_DOUBLE(y));
     }      
-    case JUMP_NE_OPCODE_REF : {
+    CASE(JUMP_NE_OPCODE_REF) : {
       DECODE_F();      
       F_JUMP(LOCAL(x) != LOCAL(y));
     }
-    case JUMP_NE_OPCODE_BYTE : {
+    CASE(JUMP_NE_OPCODE_BYTE) : {
       DECODE_F();
       F_JUMP((int8_t)LOCAL(x) != (int8_t)LOCAL(y));
     }
-    case JUMP_NE_OPCODE_INT : {
+    CASE(JUMP_NE_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((int32_t)LOCAL(x) != (int32_t)LOCAL(y));
     }
-    case JUMP_NE_OPCODE_LONG : {
+    CASE(JUMP_NE_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) != (int64_t)LOCAL(y));
     }
-    case JUMP_NE_OPCODE_FLOAT : {
+    CASE(JUMP_NE_OPCODE_FLOAT) : {
       DECODE_F();
       F_JUMP(LOCAL_FLOAT(x) != LOCAL_FLOAT(y));
     }
-    case JUMP_NE_OPCODE_DOUBLE : {
+    CASE(JUMP_NE_OPCODE_DOUBLE) : {
       DECODE_F();
       F_JUMP(LOCAL_DOUBLE(x) != LOCAL_DOUBLE(y));
     }      
-    case JUMP_LT_OPCODE_INT : {
+    CASE(JUMP_LT_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((int32_t)LOCAL(x) < (int32_t)LOCAL(y));
     }
-    case JUMP_LT_OPCODE_LONG : {
+    CASE(JUMP_LT_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) < (int64_t)LOCAL(y));
     }
-    case JUMP_LT_OPCODE_FLOAT : {
+    CASE(JUMP_LT_OPCODE_FLOAT) : {
       DECODE_F();
       F_JUMP(LOCAL_FLOAT(x) < LOCAL_FLOAT(y));
     }
-    case JUMP_LT_OPCODE_DOUBLE : {
+    CASE(JUMP_LT_OPCODE_DOUBLE) : {
       DECODE_F();
       F_JUMP(LOCAL_DOUBLE(x) < LOCAL_DOUBLE(y));
     }
-    case JUMP_GT_OPCODE_INT : {
+    CASE(JUMP_GT_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((int32_t)LOCAL(x) > (int32_t)LOCAL(y));
     }
-    case JUMP_GT_OPCODE_LONG : {
+    CASE(JUMP_GT_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) > (int64_t)LOCAL(y));
     }
-    case JUMP_GT_OPCODE_FLOAT : {
+    CASE(JUMP_GT_OPCODE_FLOAT) : {
       DECODE_F();
       F_JUMP(LOCAL_FLOAT(x) > LOCAL_FLOAT(y));
     }
-    case JUMP_GT_OPCODE_DOUBLE : {
+    CASE(JUMP_GT_OPCODE_DOUBLE) : {
       DECODE_F();
       F_JUMP(LOCAL_DOUBLE(x) > LOCAL_DOUBLE(y));
     }
-    case JUMP_LE_OPCODE_INT : {
+    CASE(JUMP_LE_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((int32_t)LOCAL(x) <= (int32_t)LOCAL(y));
     }
-    case JUMP_LE_OPCODE_LONG : {
+    CASE(JUMP_LE_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) <= (int64_t)LOCAL(y));
     }
-    case JUMP_LE_OPCODE_FLOAT : {
+    CASE(JUMP_LE_OPCODE_FLOAT) : {
       DECODE_F();
       F_JUMP(LOCAL_FLOAT(x) <= LOCAL_FLOAT(y));
     }
-    case JUMP_LE_OPCODE_DOUBLE : {
+    CASE(JUMP_LE_OPCODE_DOUBLE) : {
       DECODE_F();
       F_JUMP(LOCAL_DOUBLE(x) <= LOCAL_DOUBLE(y));
     }
-    case JUMP_GE_OPCODE_INT : {
+    CASE(JUMP_GE_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((int32_t)LOCAL(x) >= (int32_t)LOCAL(y));
     }
-    case JUMP_GE_OPCODE_LONG : {
+    CASE(JUMP_GE_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((int64_t)LOCAL(x) >= (int64_t)LOCAL(y));
     }
-    case JUMP_GE_OPCODE_FLOAT : {
+    CASE(JUMP_GE_OPCODE_FLOAT) : {
       DECODE_F();
       F_JUMP(LOCAL_FLOAT(x) >= LOCAL_FLOAT(y));
     }
-    case JUMP_GE_OPCODE_DOUBLE : {
+    CASE(JUMP_GE_OPCODE_DOUBLE) : {
       DECODE_F();
       F_JUMP(LOCAL_DOUBLE(x) >= LOCAL_DOUBLE(y));
     }
-    case JUMP_ULE_OPCODE_BYTE : {
+    CASE(JUMP_ULE_OPCODE_BYTE) : {
       DECODE_F();
       F_JUMP((uint8_t)LOCAL(x) <= (uint8_t)LOCAL(y));
     }
-    case JUMP_ULE_OPCODE_INT : {
+    CASE(JUMP_ULE_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((uint32_t)LOCAL(x) <= (uint32_t)LOCAL(y));
     }
-    case JUMP_ULE_OPCODE_LONG : {
+    CASE(JUMP_ULE_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((uint64_t)LOCAL(x) <= (uint64_t)LOCAL(y));
     }      
-    case JUMP_ULT_OPCODE_BYTE : {
+    CASE(JUMP_ULT_OPCODE_BYTE) : {
       DECODE_F();
       F_JUMP((uint8_t)LOCAL(x) < (uint8_t)LOCAL(y));
     }
-    case JUMP_ULT_OPCODE_INT : {
+    CASE(JUMP_ULT_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((uint32_t)LOCAL(x) < (uint32_t)LOCAL(y));
     }
-    case JUMP_ULT_OPCODE_LONG : {
+    CASE(JUMP_ULT_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((uint64_t)LOCAL(x) < (uint64_t)LOCAL(y));
     }      
-    case JUMP_UGE_OPCODE_BYTE : {
+    CASE(JUMP_UGE_OPCODE_BYTE) : {
       DECODE_F();
       F_JUMP((uint8_t)LOCAL(x) >= (uint8_t)LOCAL(y));
     }
-    case JUMP_UGE_OPCODE_INT : {
+    CASE(JUMP_UGE_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((uint32_t)LOCAL(x) >= (uint32_t)LOCAL(y));
     }
-    case JUMP_UGE_OPCODE_LONG : {
+    CASE(JUMP_UGE_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((uint64_t)LOCAL(x) >= (uint64_t)LOCAL(y));
     }
-    case JUMP_UGT_OPCODE_BYTE : {
+    CASE(JUMP_UGT_OPCODE_BYTE) : {
       DECODE_F();
       F_JUMP((uint8_t)LOCAL(x) > (uint8_t)LOCAL(y));
     }
-    case JUMP_UGT_OPCODE_INT : {
+    CASE(JUMP_UGT_OPCODE_INT) : {
       DECODE_F();
       F_JUMP((uint32_t)LOCAL(x) > (uint32_t)LOCAL(y));
     }
-    case JUMP_UGT_OPCODE_LONG : {
+    CASE(JUMP_UGT_OPCODE_LONG) : {
       DECODE_F();
       F_JUMP((uint64_t)LOCAL(x) > (uint64_t)LOCAL(y));
     }
-    case DISPATCH_OPCODE : {
+    CASE(DISPATCH_OPCODE) : {
       DECODE_A_UNSIGNED();
       uint32_t* tgts = (uint32_t*)(pc + 4);
       //DECODE_TGTS();
       int format = value;
-      int index = read_dispatch_table(vms, format);
+      int index = cached_dispatch(vms, pc0 - instructions, format);
       int tgt = tgts[index];
       pc = pc0 + (tgt * 4);
-      continue;
+      NEXT;
     }
-    case DISPATCH_METHOD_OPCODE : {
+    CASE(DISPATCH_METHOD_OPCODE) : {
       DECODE_A_UNSIGNED();
       uint32_t* tgts = (uint32_t*)(pc + 4);
       //DECODE_TGTS();
       int format = value;
-      int index = read_dispatch_table(vms, format);
+      int index = cached_dispatch(vms, pc0 - instructions, format);
       if(index < 2){
         int tgt = tgts[index];
         pc = pc0 + (tgt * 4);
-        continue;
+        NEXT;
       }else{
         int fid = index - 2;
         uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;
+        PROFILE_CALL(fid);
+        COUNT_ENTRY(fid);
+      COUNT_ENTRY(fid);
         pc = instructions + fpos;
-        continue;
+        NEXT;
       }
     }
-    case JUMP_REG_OPCODE : {
+    CASE(JUMP_REG_OPCODE) : {
       DECODE_C();
       int reg = x;
       uint64_t arity = y;
       int offset = value * 4;
       if(registers[reg] == arity){
         pc = pc0 + offset;
-        continue;
+        NEXT;
       }else{
-        continue;
+        NEXT;
       }
     }
-    case FNENTRY_OPCODE : {
+    CASE(FNENTRY_OPCODE) : {
       DECODE_A_UNSIGNED();
       int frame_size = value * 8 + sizeof(StackFrame);
       int size_required = frame_size + sizeof(StackFrame);
@@ -1885,14 +3084,31 @@ void vmloop (VMState* vms, uint64_t stanza_crsp){
         //Jump to stack extender          
         uint64_t fpos = (uint64_t)(code_offsets[EXTEND_STACK_FN]) * 4;
         pc = instructions + fpos;
-        continue;        
+        NEXT;        
       }
-      continue;
+      NEXT;
+    }
+    CASE(LAZY_ENTRY_OPCODE) : {
+      //The function id follows in the next word.
+      uint32_t fid = PC_INT();
+      //Encode the function. This replaces its code offset.
+      SAVE_STATE();
+      call_encode_function(vms, fid);
+      RESTORE_STATE();
+      RELOAD_CODE();
+      //Enter the encoded function.
+      uint64_t fpos = (uint64_t)(code_offsets[fid]) * 4;
+      pc = instructions + fpos;
+      NEXT;
     }
     }
 
-    //Done    
+    //Done
+    #ifdef USE_THREADED_DISPATCH
+    op_INVALID:
+    #endif
     printf("Invalid opcode: %d\n", opcode);
+    if(vms->trace != NULL) print_vm_trace(stderr, vms->trace);
     exit(-1);
   }
 }
@@ -1916,6 +3132,20 @@ typedef struct {
   int value;
 } DKV;
 
+//A range holds the value for all types between lo and hi inclusive.
+typedef struct {
+  int lo;
+  int hi;
+  int value;
+} DRange;
+
+//A direct table holds -n values indexed by (type - min), followed
+//by the default value.
+typedef struct {
+  int min;
+  int values[];
+} DirectTable;
+
 int PRIM_TYPEIDS[] = {INT_TYPE, 0, 0, BYTE_TYPE, CHAR_TYPE, FLOAT_TYPE};
 
 int argtype (VMState* vms, int i){
@@ -1933,16 +3163,38 @@ int argtype (VMState* vms, int i){
   }
 }
 
-DKV* small_etable (TrieTable* trie_table){
+DRange* trie_ranges (TrieTable* trie_table){
   void* p = trie_table;
   return p + sizeof(TrieTable);
 }
 
+//Ranges are sorted, so a type below the current range lies in
+//none of the ranges that remain.
+int lookup_ranges (DRange* ranges, int t, int n){
+  for(int i=0; i<n; i++){
+    DRange r = ranges[i];
+    if(t < r.lo) break;
+    if(t <= r.hi) return r.value;
+  }
+  return ranges[n].lo;
+}
+
 DKV* big_etable (DTable* dtable, int n){
   void* p = dtable->dtable + n;
   return p;
 }
 
+DirectTable* trie_direct_table (TrieTable* trie_table){
+  void* p = trie_table;
+  return p + sizeof(TrieTable);
+}
+
+int lookup_direct_table (DirectTable* table, int t, int n){
+  unsigned int i = (unsigned int)(t - table->min);
+  if(i < (unsigned int)n) return table->values[i];
+  return table->values[n];
+}
+
 DTable* trie_dtable (TrieTable* trie_table){
   void* p = trie_table;
   return p + sizeof(TrieTable);
@@ -1952,14 +3204,6 @@ int default_value (DKV* etable, int n){
   return etable[n].key;
 }
 
-int lookup_small_etable (DKV* etable, int t, int n){
-  for(int i=0; i<n; i++){
-    DKV e = etable[i];
-    if(e.key == t) return e.value;
-  }
-  return default_value(etable,n);
-}
-
 int lookup_etable (DKV* etable, int slot, int t, int n){
   DKV e = etable[slot];
   if(e.key == t) return e.value;
@@ -1980,8 +3224,10 @@ int dhash (int d, int x, int n){
 int lookup_trie_table (VMState* vms, TrieTable* trie_table){
   int n = trie_table->n;
   int type = argtype(vms, trie_table->index);
-  if(n <= 4){
-    return lookup_small_etable(small_etable(trie_table), type, n);
+  if(n < 0){
+    return lookup_direct_table(trie_direct_table(trie_table), type, -n);
+  }else if(n <= 4){
+    return lookup_ranges(trie_ranges(trie_table), type, n);
   }else{
     DTable* dtable = trie_dtable(trie_table);
     int dslot = dhash(dtable->d0, type, n);
@@ -2004,3 +3250,82 @@ int read_dispatch_table (VMState* vms, int format){
     table_offset = value;
   }
 }
+
+//============================================================
+//=================== Dispatch Caches ========================
+//============================================================
+
+//Each dispatch instruction is identified by its site, its offset
+//in the instructions. Sites are hashed into a fixed number of sets,
+//each holding a small number of entries, so that a site that sees
+//a few different argument types (polymorphic) will hit as well as
+//one that sees only one (monomorphic). A hit replaces the trie walk
+//with one argtype check per level of the walk.
+//
+//The result of a trie walk depends only on the types of the
+//arguments examined along the way, so an entry remains valid until
+//the trie tables are rebuilt, at which point clear_dispatch_cache
+//must be called.
+
+void clear_dispatch_cache (VMState* vms){
+  if(vms->dispatch_cache == NULL){
+    vms->dispatch_cache = (DispatchCacheSet*)malloc(DISPATCH_CACHE_SITES * sizeof(DispatchCacheSet));
+    if(vms->dispatch_cache == NULL){
+      printf("Could not allocate dispatch cache.\n");
+      exit(-1);
+    }
+  }
+  for(int i=0; i<DISPATCH_CACHE_SITES; i++){
+    DispatchCacheSet* set = &vms->dispatch_cache[i];
+    for(int j=0; j<DISPATCH_CACHE_WAYS; j++)
+      set->entries[j].site = -1;
+    set->next_way = 0;
+  }
+}
+
+int cached_dispatch (VMState* vms, int site, int format){
+  DispatchCacheSet* set = &vms->dispatch_cache[(site >> 2) & (DISPATCH_CACHE_SITES - 1)];
+
+  //Look for an entry whose recorded types all match
+  for(int i=0; i<DISPATCH_CACHE_WAYS; i++){
+    DispatchCacheEntry* e = &set->entries[i];
+    if(e->site == site){
+      int hit = 1;
+      for(int d=0; d<e->depth; d++){
+        if(argtype(vms, e->args[d]) != e->types[d]){
+          hit = 0;
+          break;
+        }
+      }
+      if(hit) return e->result;
+    }
+  }
+
+  //Miss: walk the trie tables, recording the path taken
+  DispatchCacheEntry entry;
+  int* trie_table = vms->trie_table[format];
+  int table_offset = 0;
+  int depth = 0;
+  while(1){
+    TrieTable* table = (TrieTable*)(trie_table + table_offset);
+    if(depth < DISPATCH_CACHE_DEPTH){
+      entry.args[depth] = table->index;
+      entry.types[depth] = argtype(vms, table->index);
+    }
+    depth++;
+    int value = lookup_trie_table(vms, table);
+    if(value < 0){
+      int result = -value - 1;
+      //Paths that are too deep are not cached
+      if(depth <= DISPATCH_CACHE_DEPTH){
+        entry.site = site;
+        entry.depth = depth;
+        entry.result = result;
+        set->entries[set->next_way] = entry;
+        set->next_way = (set->next_way + 1) % DISPATCH_CACHE_WAYS;
+      }
+      return result;
+    }
+    table_offset = value;
+  }
+}
@@ -27,6 +27,13 @@ void init_fmalloc ();
 //Stanza Alloc
 void* stz_malloc (long size);
 void stz_free (void* ptr);
+void* stz_malloc_large (long size);
+void stz_free_large (void* ptr, long size);
+void* stz_reserve_space (long size);
+int stz_commit_space (void* ptr, long size);
+void stz_decommit_space (void* ptr, long size);
+void stz_release_space (void* ptr, long size);
+int64_t stz_available_memory ();
 
 //     Stanza Defined Entities
 //     =======================
@@ -49,6 +56,7 @@ typedef struct{
 typedef struct{
   int pool_index;
   int mark;
+  StackFrame* scanned_top;
   StackFrame frames[];
 } StackFrameHeader;
 
@@ -69,6 +77,111 @@ int input_argc;
 char** input_argv;
 int input_argv_needs_free;
 
+//     Garbage Collector Configuration
+//     ===============================
+//Size of the nursery of the generational collector, in bytes.
+//The generational collector is disabled when it is zero.
+int64_t stz_nursery_size;
+//Number of threads used for full collections, between 1 and
+//MAX_GC_THREADS. Collections are sequential when it is one.
+int64_t stz_gc_threads;
+//Print one line per collection to stderr when non-zero.
+int64_t stz_gc_log;
+//Switch to the mark-compact collector the first time the heap
+//grows when non-zero.
+int64_t stz_gc_compact;
+//Non-zero when the program was compiled with the GC-WRITE-BARRIER
+//flag. The generational collector and the immortal region rely on
+//the barrier, so they are disabled otherwise.
+#ifdef STANZA_WRITE_BARRIER
+  int64_t stz_write_barrier = 1;
+#else
+  int64_t stz_write_barrier = 0;
+#endif
+//Number of bytes of address space reserved for each of the two
+//semispaces in main. The heap grows in place up to this size.
+int64_t stz_heap_reserved;
+
+//     Heap and Stack Configuration
+//     ============================
+//Initial size of each semispace, in bytes.
+int64_t stz_initial_heap_size;
+//Initial value of MAXIMUM-HEAP-SIZE in core, in bytes.
+int64_t stz_max_heap_size;
+//Size of new stacks, in bytes.
+int64_t stz_initial_stack_size;
+//Factor by which the heap grows when it is too small.
+double stz_heap_growth;
+
+//     Allocation Sampling
+//     ===================
+//Number of allocated bytes between allocation samples, or zero if
+//allocations are not sampled. See Allocation Sampling below.
+int64_t stz_alloc_sample_interval;
+//The real limit of the initial heap, when main has lowered its
+//limit to the first sample point, and NULL otherwise.
+char* stz_alloc_sample_limit;
+//The initial heap. Only the heap initialized by main is sampled.
+char* alloc_sample_heap;
+
+//Reads a size in bytes, with an optional K, M or G suffix, from the
+//environment variable name. Returns default_size if it is not set.
+//The size is rounded up to a multiple of 8 bytes.
+int64_t size_from_env (const char* name, int64_t default_size){
+  char* value = getenv(name);
+  if(value == NULL) return default_size;
+  char* end;
+  int64_t size = strtoll(value, &end, 10);
+  switch(*end){
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+  }
+  if(end == value || *end != 0 || size <= 0){
+    fprintf(stderr, "Invalid size for %s: %s\n", name, value);
+    exit(-1);
+  }
+  return (size + 7) & ~7L;
+}
+
+//Reads a number of collector threads from the environment variable
+//name. Returns default_threads if it is not set. The number is
+//clamped to between 1 and MAX_GC_THREADS.
+#define MAX_GC_THREADS 64
+int64_t threads_from_env (const char* name, int64_t default_threads){
+  char* value = getenv(name);
+  if(value == NULL) return default_threads;
+  char* end;
+  int64_t threads = strtoll(value, &end, 10);
+  if(end == value || *end != 0){
+    fprintf(stderr, "Invalid number of threads for %s: %s\n", name, value);
+    exit(-1);
+  }
+  if(threads < 1 || threads > MAX_GC_THREADS){
+    int64_t clamped = threads < 1 ? 1 : MAX_GC_THREADS;
+    fprintf(stderr, "%s must be between 1 and %d, using %ld.\n",
+            name, MAX_GC_THREADS, (long)clamped);
+    threads = clamped;
+  }
+  return threads;
+}
+
+void read_heap_configuration (){
+  stz_initial_heap_size = size_from_env("STANZA_INITIAL_HEAP", 1024 * 1024);
+  stz_max_heap_size = size_from_env("STANZA_MAX_HEAP", 4L * 1024L * 1024L * 1024L);
+  stz_initial_stack_size = size_from_env("STANZA_INITIAL_STACK", 4 * 1024);
+  if(stz_initial_heap_size > stz_max_heap_size){
+    fprintf(stderr, "STANZA_INITIAL_HEAP cannot be larger than STANZA_MAX_HEAP.\n");
+    exit(-1);
+  }
+  char* growth = getenv("STANZA_HEAP_GROWTH");
+  stz_heap_growth = growth == NULL ? 2.0 : atof(growth);
+  if(stz_heap_growth <= 1.0){
+    fprintf(stderr, "STANZA_HEAP_GROWTH must be larger than 1.\n");
+    exit(-1);
+  }
+}
+
 //     Main Driver
 //     ===========
 void* alloc (VMInit* init, long type, long size){
@@ -80,17 +193,27 @@ void* alloc (VMInit* init, long type, long size){
 
 uint64_t alloc_stack (VMInit* init){
   Stack* stack = alloc(init, STACK_TYPE, sizeof(Stack));
-  int initial_stack_size = 4 * 1024;
+  long initial_stack_size = stz_initial_stack_size;
   long size = initial_stack_size + sizeof(StackFrameHeader);
   StackFrameHeader* frameheader = (StackFrameHeader*)stz_malloc(size);
   frameheader->pool_index = -1;
   frameheader->mark = 0;
+  frameheader->scanned_top = NULL;
   stack->size = initial_stack_size;
   stack->frames = frameheader->frames;
   stack->stack_pointer = NULL;
   return (uint64_t)stack - 8 + 1;  
 }
 
+char* alloc_semispace (long size){
+  char* space = (char*)stz_reserve_space(stz_heap_reserved);
+  if(space == NULL || stz_commit_space(space, size) != 0){
+    fprintf(stderr, "Could not allocate the initial heap.\n");
+    exit(-1);
+  }
+  return space;
+}
+
 int main (int argc, char* argv[]) {
   #if defined(FMALLOC)
     init_fmalloc();
@@ -101,14 +224,37 @@ int main (int argc, char* argv[]) {
   input_argv_needs_free = 0;
   VMInit init;
 
+  //Read collector configuration
+  stz_nursery_size = size_from_env("STANZA_NURSERY_SIZE", 0);
+  if(stz_nursery_size > 0 && !stz_write_barrier){
+    fprintf(stderr, "STANZA_NURSERY_SIZE requires a program compiled with -flags GC-WRITE-BARRIER.\n");
+    exit(-1);
+  }
+  stz_gc_threads = threads_from_env("STANZA_GC_THREADS", 1);
+  stz_gc_log = getenv("STANZA_GC_LOG") != NULL;
+  stz_gc_compact = getenv("STANZA_GC_COMPACT") != NULL;
+  stz_alloc_sample_interval = size_from_env("STANZA_ALLOC_SAMPLE", 0);
+  read_heap_configuration();
+
   //Allocate heap and free
-  int initial_heap_size = 1024 * 1024;
-  init.heap = (char*)stz_malloc(initial_heap_size);
+  long initial_heap_size = stz_initial_heap_size;
+  char* reserve_heap = getenv("STANZA_RESERVE_HEAP");
+  stz_heap_reserved = reserve_heap == NULL ? initial_heap_size : stz_max_heap_size;
+  init.heap = alloc_semispace(initial_heap_size);
   init.heap_limit = init.heap + initial_heap_size;
   init.heap_top = init.heap;
-  init.free = (char*)stz_malloc(initial_heap_size);
+  init.free = alloc_semispace(initial_heap_size);
   init.free_limit = init.free + initial_heap_size;
 
+  //Lower the heap limit to the first allocation sample
+  if(stz_alloc_sample_interval > 0){
+    alloc_sample_heap = init.heap;
+    if(stz_alloc_sample_interval < initial_heap_size){
+      stz_alloc_sample_limit = init.heap_limit;
+      init.heap_limit = init.heap + stz_alloc_sample_interval;
+    }
+  }
+
   //Allocate stacks
   init.current_stack = alloc_stack(&init);
   init.system_stack = alloc_stack(&init);   
@@ -477,6 +623,140 @@ void stz_free (void* ptr){
   #endif
 }
 
+//Large objects are mapped individually so that their pages are
+//returned to the OS as soon as they die. The memory is zeroed.
+void* stz_malloc_large (long size){
+  #if defined(FMALLOC)
+    void* p = fmalloc(size);
+    memset(p, 0, size);
+    return p;
+  #elif defined(PLATFORM_WINDOWS)
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  #else
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  #endif
+}
+
+void stz_free_large (void* ptr, long size){
+  #if defined(FMALLOC)
+    ffree(ptr);
+  #elif defined(PLATFORM_WINDOWS)
+    VirtualFree(ptr, 0, MEM_RELEASE);
+  #else
+    munmap(ptr, size);
+  #endif
+}
+
+//The semispaces of the heap are reserved as address space, and
+//their pages are committed as the heap grows. Decommitted pages
+//are returned to the OS.
+void* stz_reserve_space (long size){
+  #if defined(FMALLOC)
+    return fmalloc(size);
+  #elif defined(PLATFORM_WINDOWS)
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+  #else
+    void* p = mmap(NULL, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  #endif
+}
+
+static long page_size (){
+  #if defined(PLATFORM_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+  #else
+    return sysconf(_SC_PAGESIZE);
+  #endif
+}
+
+//Commits every page overlapping [ptr, ptr + size).
+//Returns 0 on success.
+int stz_commit_space (void* ptr, long size){
+  #if defined(FMALLOC)
+    return 0;
+  #else
+    long mask = page_size() - 1;
+    char* start = (char*)((uintptr_t)ptr & ~mask);
+    char* end = (char*)(((uintptr_t)ptr + size + mask) & ~mask);
+    if(end <= start) return 0;
+    #if defined(PLATFORM_WINDOWS)
+      return VirtualAlloc(start, end - start, MEM_COMMIT, PAGE_READWRITE) == NULL ? -1 : 0;
+    #else
+      return mprotect(start, end - start, PROT_READ | PROT_WRITE);
+    #endif
+  #endif
+}
+
+//Decommits every page lying entirely within [ptr, ptr + size).
+void stz_decommit_space (void* ptr, long size){
+  #if !defined(FMALLOC)
+    long mask = page_size() - 1;
+    char* start = (char*)(((uintptr_t)ptr + mask) & ~mask);
+    char* end = (char*)(((uintptr_t)ptr + size) & ~mask);
+    if(end <= start) return;
+    #if defined(PLATFORM_WINDOWS)
+      VirtualFree(start, end - start, MEM_DECOMMIT);
+    #else
+      madvise(start, end - start, MADV_DONTNEED);
+      mprotect(start, end - start, PROT_NONE);
+    #endif
+  #endif
+}
+
+void stz_release_space (void* ptr, long size){
+  #if defined(FMALLOC)
+    ffree(ptr);
+  #elif defined(PLATFORM_WINDOWS)
+    VirtualFree(ptr, 0, MEM_RELEASE);
+  #else
+    munmap(ptr, size);
+  #endif
+}
+
+//Returns the number of bytes of physical memory available to the
+//program, or -1 if it is unknown.
+static int64_t read_available_memory (){
+  #if defined(PLATFORM_WINDOWS)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if(!GlobalMemoryStatusEx(&status)) return -1;
+    return status.ullAvailPhys;
+  #elif defined(PLATFORM_LINUX)
+    //MemAvailable also counts the page cache that can be reclaimed.
+    FILE* f = fopen("/proc/meminfo", "r");
+    if(f == NULL) return -1;
+    char line[256];
+    int64_t available = -1;
+    while(fgets(line, sizeof(line), f) != NULL){
+      long kb;
+      if(sscanf(line, "MemAvailable: %ld kB", &kb) == 1){
+        available = (int64_t)kb * 1024;
+        break;
+      }
+    }
+    fclose(f);
+    return available;
+  #else
+    return -1;
+  #endif
+}
+
+//The collector asks after every collection that grows the heap,
+//so the answer is read again at most once per second.
+int64_t stz_available_memory (){
+  static int64_t available = -1;
+  static int64_t read_time = -1;
+  int64_t time = current_time_ms();
+  if(read_time < 0 || time - read_time >= 1000){
+    available = read_available_memory();
+    read_time = time;
+  }
+  return available;
+}
+
 //============================================================
 //================= Process Runtime ==========================
 //============================================================
@@ -961,3 +1241,627 @@ void retrieve_process_state (long pid, ProcessState* s, int wait_for_termination
 //============================================================
 //============== End Process Runtime =========================
 //============================================================
+
+//============================================================
+//=============== Parallel Garbage Collector =================
+//============================================================
+
+//------------------------------------------------------------
+//------------------- Structures -----------------------------
+//------------------------------------------------------------
+
+//Mirrors of the collector tables defined in core.
+typedef struct{
+  char* name;
+  int size;
+  int item_size;
+  int num_roots;
+  int roots[];
+} ClassRecord;
+
+typedef struct{
+  char* name;
+  int base_size;
+  int item_size;
+  int num_base_roots;
+  int num_item_roots;
+  int roots[];
+} ArrayRecord;
+
+typedef struct{
+  int length;
+  int roots[];
+} GlobalRoots;
+
+typedef struct{
+  int size;
+  int num_roots;
+  int roots[];
+} StackMap;
+
+typedef struct{
+  char* instructions;
+  uint64_t* registers;
+  uint64_t* global_offsets;
+  char* global_mem;
+  uint64_t* const_table;
+  char* const_mem;
+  int* data_offsets;
+  char* data_mem;
+  int* code_offsets;
+  uint64_t* heap;
+  uint64_t* heap_top;
+  uint64_t* heap_limit;
+  uint64_t* free;
+  uint64_t* free_limit;
+  uint64_t current_stack;
+  uint64_t system_stack;
+  uint64_t* system_registers;
+  ClassRecord** class_table;
+  GlobalRoots* global_root_table;
+  StackMap** stackmap_table;
+  void* info_table;
+  void* extern_table;
+  void* callback_index_table;
+} VMState;
+
+//Header of an object in the large object space of core. Large
+//objects are marked instead of copied.
+typedef struct LargeObject{
+  struct LargeObject* next;
+  int64_t size;
+  int64_t mark;
+  struct LargeObject* pending;
+  uint64_t object[];
+} LargeObject;
+
+//Header values of objects being moved. BUSY marks an object
+//that another worker is copying right now.
+#define BROKEN_HEART ((uint64_t)-1)
+#define BUSY ((uint64_t)-2)
+
+//Each worker copies into its own local allocation buffer (LAB)
+//carved from the to-space. Objects bigger than GC_LARGE_OBJECT
+//bypass the LABs, which bounds the space wasted at LAB ends.
+#define GC_LAB_SIZE (32 * 1024)
+#define GC_LARGE_OBJECT (GC_LAB_SIZE / 16)
+
+typedef struct{
+  uint64_t* start;
+  uint64_t* end;
+} GCRange;
+
+//Mirrors GCCounters in core.
+typedef struct{
+  int64_t objects_copied;
+  int64_t bytes_copied;
+  int64_t frames_scanned;
+  int64_t collections;
+  int64_t total_pause_us;
+  int64_t max_pause_us;
+  int64_t heap_before;
+  int64_t heap_after;
+} GCCounters;
+
+typedef struct{
+  VMState* vms;
+  int64_t num_workers;
+  uint64_t stack_tag;
+  uint64_t tracker_tag;
+  uint64_t filler_tag;
+  uint64_t false_marker;
+  //Objects outside of the from-space are immortal or large objects
+  uint64_t* from_start;
+  uint64_t* from_end;
+  uint64_t* immortal_start;
+  uint64_t* immortal_end;
+  int64_t first_const;
+  //Shared to-space allocation pointer
+  char* top;
+  //Ranges of copied objects that still need to be scanned
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  GCRange* queue;
+  long queue_length;
+  long queue_capacity;
+  int num_idle;
+  int done;
+  //Set once num_workers counts the threads actually started
+  int started;
+} ParallelGC;
+
+typedef struct{
+  ParallelGC* gc;
+  int index;
+  uint64_t* lab_top;
+  uint64_t* lab_limit;
+  uint64_t* scan;
+  uint64_t* trackers;
+  int64_t objects_copied;
+  int64_t bytes_copied;
+  int64_t frames_scanned;
+} GCWorker;
+
+//------------------------------------------------------------
+//-------------------- Work Queue ----------------------------
+//------------------------------------------------------------
+
+static void gc_push_range (ParallelGC* gc, uint64_t* start, uint64_t* end){
+  if(start == end) return;
+  pthread_mutex_lock(&gc->lock);
+  if(gc->queue_length == gc->queue_capacity){
+    gc->queue_capacity = gc->queue_capacity * 2;
+    gc->queue = (GCRange*)realloc(gc->queue, gc->queue_capacity * sizeof(GCRange));
+    if(gc->queue == NULL){
+      printf("Could not allocate GC work queue.\n");
+      exit(-1);
+    }
+  }
+  gc->queue[gc->queue_length].start = start;
+  gc->queue[gc->queue_length].end = end;
+  gc->queue_length++;
+  if(gc->num_idle > 0) pthread_cond_signal(&gc->cond);
+  pthread_mutex_unlock(&gc->lock);
+}
+
+//Returns 0 once every worker is idle and the queue is empty.
+static int gc_take_range (ParallelGC* gc, GCRange* r){
+  pthread_mutex_lock(&gc->lock);
+  gc->num_idle++;
+  while(gc->queue_length == 0 && !gc->done){
+    if(gc->num_idle == gc->num_workers){
+      gc->done = 1;
+      pthread_cond_broadcast(&gc->cond);
+    }else{
+      pthread_cond_wait(&gc->cond, &gc->lock);
+    }
+  }
+  int found = 0;
+  if(gc->queue_length > 0){
+    *r = gc->queue[--gc->queue_length];
+    gc->num_idle--;
+    found = 1;
+  }
+  pthread_mutex_unlock(&gc->lock);
+  return found;
+}
+
+//------------------------------------------------------------
+//-------------------- Allocation ----------------------------
+//------------------------------------------------------------
+
+static long object_size_on_heap (long sz){
+  long ceiled = (8 + sz + 7) & -8;
+  return ceiled < 16 ? 16 : ceiled;
+}
+
+static long gc_num_bytes (ParallelGC* gc, uint64_t* obj, uint64_t tag){
+  ClassRecord* c = gc->vms->class_table[tag];
+  if(c->item_size == 0) return object_size_on_heap(c->size);
+  ArrayRecord* a = (ArrayRecord*)c;
+  return object_size_on_heap(a->base_size + a->item_size * (long)obj[1]);
+}
+
+//Overwrite [p, end) with a byte array so that the heap stays
+//parseable. Gaps are always zero or at least 16 bytes.
+static void gc_fill (ParallelGC* gc, uint64_t* p, uint64_t* end){
+  if(p == end) return;
+  ArrayRecord* a = (ArrayRecord*)gc->vms->class_table[gc->filler_tag];
+  p[0] = gc->filler_tag;
+  p[1] = (char*)end - (char*)p - 8 - a->base_size;
+}
+
+static void gc_retire_lab (GCWorker* w){
+  gc_push_range(w->gc, w->scan, w->lab_top);
+  gc_fill(w->gc, w->lab_top, w->lab_limit);
+  w->scan = w->lab_top = w->lab_limit;
+}
+
+static uint64_t* gc_alloc (GCWorker* w, long n){
+  //Large objects get their own range and are scanned by any worker.
+  if(n > GC_LARGE_OBJECT)
+    return (uint64_t*)__atomic_fetch_add(&w->gc->top, n, __ATOMIC_RELAXED);
+  //Objects fit if they leave no gap smaller than the smallest object.
+  long remaining = (char*)w->lab_limit - (char*)w->lab_top;
+  if(n == remaining || n + 16 <= remaining){
+    uint64_t* p = w->lab_top;
+    w->lab_top = (uint64_t*)((char*)p + n);
+    return p;
+  }
+  //Otherwise start a new LAB.
+  gc_retire_lab(w);
+  uint64_t* lab = (uint64_t*)__atomic_fetch_add(&w->gc->top, GC_LAB_SIZE, __ATOMIC_RELAXED);
+  w->scan = lab;
+  w->lab_top = (uint64_t*)((char*)lab + n);
+  w->lab_limit = (uint64_t*)((char*)lab + GC_LAB_SIZE);
+  return lab;
+}
+
+//------------------------------------------------------------
+//--------------------- Copying ------------------------------
+//------------------------------------------------------------
+
+static LargeObject* gc_large_object (uint64_t* obj){
+  return (LargeObject*)((char*)obj - sizeof(LargeObject));
+}
+
+static uint64_t gc_forward (GCWorker* w, uint64_t ref){
+  if((ref & 7) != 1) return ref;
+  uint64_t* obj = (uint64_t*)(ref - 1);
+  //Immortal objects and large objects stay in place. Large objects
+  //are scanned by whichever worker marks them first. The only
+  //moved ones were promoted to the immortal region by core.
+  if(obj < w->gc->from_start || obj >= w->gc->from_end){
+    if(obj >= w->gc->immortal_start && obj < w->gc->immortal_end) return ref;
+    if(obj[0] == BROKEN_HEART) return obj[1];
+    int64_t unmarked = 0;
+    LargeObject* lo = gc_large_object(obj);
+    if(__atomic_compare_exchange_n(&lo->mark, &unmarked, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      gc_push_range(w->gc, obj, obj + gc_num_bytes(w->gc, obj, obj[0]) / 8);
+    return ref;
+  }
+  while(1){
+    uint64_t tag = __atomic_load_n(obj, __ATOMIC_ACQUIRE);
+    if(tag == BROKEN_HEART)
+      return __atomic_load_n(obj + 1, __ATOMIC_RELAXED);
+    if(tag == BUSY)
+      continue;
+    //Claim the object, then copy it and install the broken heart.
+    if(__atomic_compare_exchange_n(obj, &tag, BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+      long n = gc_num_bytes(w->gc, obj, tag);
+      uint64_t* copy = gc_alloc(w, n);
+      memcpy(copy, obj, n);
+      copy[0] = tag;
+      w->objects_copied++;
+      w->bytes_copied += n;
+      uint64_t forward = (uint64_t)copy + 1;
+      __atomic_store_n(obj + 1, forward, __ATOMIC_RELAXED);
+      __atomic_store_n(obj, BROKEN_HEART, __ATOMIC_RELEASE);
+      if(n > GC_LARGE_OBJECT)
+        gc_push_range(w->gc, copy, (uint64_t*)((char*)copy + n));
+      return forward;
+    }
+  }
+}
+
+static uint64_t gc_weak_forward (ParallelGC* gc, uint64_t ref){
+  if((ref & 7) != 1) return ref;
+  uint64_t* obj = (uint64_t*)(ref - 1);
+  if(obj < gc->from_start || obj >= gc->from_end){
+    if(obj >= gc->immortal_start && obj < gc->immortal_end) return ref;
+    if(obj[0] == BROKEN_HEART) return obj[1];
+    return gc_large_object(obj)->mark ? ref : gc->false_marker;
+  }
+  if(obj[0] == BROKEN_HEART) return obj[1];
+  return gc->false_marker;
+}
+
+static void gc_scan_frames (GCWorker* w, StackFrame* frames, StackFrame* end){
+  if(frames == NULL) return;
+  StackFrameHeader* header = (StackFrameHeader*)((char*)frames - sizeof(StackFrameHeader));
+  header->mark = 1;
+  StackMap** maps = w->gc->vms->stackmap_table;
+  StackFrame* f = frames;
+  while(f <= end){
+    StackMap* map = maps[f->liveness_map];
+    for(int i=0; i<map->num_roots; i++){
+      int s = map->roots[i];
+      f->slots[s] = gc_forward(w, f->slots[s]);
+    }
+    w->frames_scanned++;
+    f = (StackFrame*)((char*)f + map->size);
+  }
+}
+
+//Scan the object at p and return the address after it.
+static uint64_t* gc_scan_object (GCWorker* w, uint64_t* p){
+  ParallelGC* gc = w->gc;
+  uint64_t tag = p[0];
+  ClassRecord* c = gc->vms->class_table[tag];
+  uint64_t* slots = p + 1;
+  if(c->item_size == 0){
+    //Liveness trackers are chained and fixed up after the scan.
+    if(tag == gc->tracker_tag){
+      p[2] = (uint64_t)w->trackers;
+      w->trackers = p;
+    }else{
+      if(tag == gc->stack_tag){
+        Stack* s = (Stack*)slots;
+        gc_scan_frames(w, s->frames, s->stack_pointer);
+      }
+      for(int i=0; i<c->num_roots; i++)
+        slots[c->roots[i]] = gc_forward(w, slots[c->roots[i]]);
+    }
+    return p + object_size_on_heap(c->size) / 8;
+  }else{
+    ArrayRecord* a = (ArrayRecord*)c;
+    long len = slots[0];
+    int* base_roots = a->roots;
+    int* item_roots = a->roots + a->num_base_roots;
+    for(int i=0; i<a->num_base_roots; i++)
+      slots[base_roots[i]] = gc_forward(w, slots[base_roots[i]]);
+    if(a->num_item_roots > 0){
+      uint64_t* items = (uint64_t*)((char*)slots + a->base_size);
+      for(long n=0; n<len; n++){
+        for(int i=0; i<a->num_item_roots; i++)
+          items[item_roots[i]] = gc_forward(w, items[item_roots[i]]);
+        items = (uint64_t*)((char*)items + a->item_size);
+      }
+    }
+    return p + object_size_on_heap(a->base_size + a->item_size * len) / 8;
+  }
+}
+
+//------------------------------------------------------------
+//---------------------- Workers -----------------------------
+//------------------------------------------------------------
+
+static void gc_scan_roots (GCWorker* w){
+  ParallelGC* gc = w->gc;
+  VMState* vms = gc->vms;
+  int stride = gc->num_workers;
+  //Global roots
+  uint64_t* globals = (uint64_t*)vms->global_mem;
+  GlobalRoots* roots = vms->global_root_table;
+  for(int i=w->index; i<roots->length; i+=stride){
+    int r = roots->roots[i];
+    globals[r] = gc_forward(w, globals[r]);
+  }
+  //Const roots, except the immortal ones
+  int nconsts = *(int*)vms->const_mem;
+  for(int i=gc->first_const+w->index; i<nconsts; i+=stride)
+    vms->const_table[i] = gc_forward(w, vms->const_table[i]);
+  //Stack roots
+  if(w->index == 0){
+    vms->current_stack = gc_forward(w, vms->current_stack);
+    vms->system_stack = gc_forward(w, vms->system_stack);
+  }
+}
+
+static void* gc_worker (void* arg){
+  GCWorker* w = (GCWorker*)arg;
+  //Roots are divided by the number of workers, so wait until it is
+  //known how many threads were started.
+  ParallelGC* gc = w->gc;
+  pthread_mutex_lock(&gc->lock);
+  while(!gc->started) pthread_cond_wait(&gc->cond, &gc->lock);
+  pthread_mutex_unlock(&gc->lock);
+  gc_scan_roots(w);
+  while(1){
+    //Scan everything copied into our own LAB.
+    while(w->scan < w->lab_top){
+      uint64_t* p = w->scan;
+      w->scan = p + gc_num_bytes(w->gc, p, p[0]) / 8;
+      gc_scan_object(w, p);
+    }
+    //Then help with the ranges of other workers.
+    GCRange r;
+    if(!gc_take_range(w->gc, &r)) return NULL;
+    uint64_t* p = r.start;
+    while(p < r.end)
+      p = gc_scan_object(w, p);
+  }
+}
+
+//Copy all live objects in [from_start, from_top) into the to-space
+//vms->heap, and mark the live large objects. The to-space may
+//already hold objects copied by core, which are scanned here. The
+//first first_const constants are immortal, and are not scanned.
+//The work done is added to counters.
+//Returns 0 without doing anything if the to-space cannot also absorb
+//the LAB fragmentation, in which case core falls back to its
+//sequential Cheney scan.
+int stz_parallel_collect (VMState* vms, int64_t num_workers,
+                          uint64_t* from_start, uint64_t* from_top,
+                          uint64_t* immortal_start, uint64_t* immortal_end,
+                          int64_t first_const,
+                          uint64_t stack_tag, uint64_t tracker_tag,
+                          uint64_t filler_tag, uint64_t false_marker,
+                          GCCounters* counters){
+  int64_t from_size = (char*)from_top - (char*)from_start;
+  int64_t worst_case = from_size + from_size / 8 + num_workers * GC_LAB_SIZE;
+  if((char*)vms->heap_top + worst_case > (char*)vms->heap_limit)
+    return 0;
+
+  ParallelGC gc;
+  gc.vms = vms;
+  gc.num_workers = num_workers;
+  gc.stack_tag = stack_tag;
+  gc.tracker_tag = tracker_tag;
+  gc.filler_tag = filler_tag;
+  gc.false_marker = false_marker;
+  gc.from_start = from_start;
+  gc.from_end = from_top;
+  gc.immortal_start = immortal_start;
+  gc.immortal_end = immortal_end;
+  gc.first_const = first_const;
+  gc.top = (char*)vms->heap_top;
+  pthread_mutex_init(&gc.lock, NULL);
+  pthread_cond_init(&gc.cond, NULL);
+  gc.queue_capacity = 1024;
+  gc.queue_length = 0;
+  gc.queue = (GCRange*)malloc(gc.queue_capacity * sizeof(GCRange));
+  gc.num_idle = 0;
+  gc.done = 0;
+  gc.started = 0;
+  gc_push_range(&gc, vms->heap, vms->heap_top);
+
+  //Launch the workers. The calling thread is worker 0.
+  GCWorker* workers = (GCWorker*)malloc(num_workers * sizeof(GCWorker));
+  pthread_t* threads = (pthread_t*)malloc(num_workers * sizeof(pthread_t));
+  if(gc.queue == NULL || workers == NULL || threads == NULL){
+    printf("Could not allocate GC workers.\n");
+    exit(-1);
+  }
+  for(int i=0; i<num_workers; i++){
+    workers[i].gc = &gc;
+    workers[i].index = i;
+    workers[i].lab_top = NULL;
+    workers[i].lab_limit = NULL;
+    workers[i].scan = NULL;
+    workers[i].trackers = NULL;
+    workers[i].objects_copied = 0;
+    workers[i].bytes_copied = 0;
+    workers[i].frames_scanned = 0;
+  }
+  //If a thread cannot be created, continue with the ones that were.
+  int num_started = 1;
+  while(num_started < num_workers &&
+        pthread_create(&threads[num_started], NULL, gc_worker, &workers[num_started]) == 0)
+    num_started++;
+  num_workers = num_started;
+  pthread_mutex_lock(&gc.lock);
+  gc.num_workers = num_workers;
+  gc.started = 1;
+  pthread_cond_broadcast(&gc.cond);
+  pthread_mutex_unlock(&gc.lock);
+  gc_worker(&workers[0]);
+  for(int i=1; i<num_workers; i++)
+    pthread_join(threads[i], NULL);
+
+  //Fill the unused tails of the LABs, and fix up the trackers.
+  for(int i=0; i<num_workers; i++){
+    gc_fill(&gc, workers[i].lab_top, workers[i].lab_limit);
+    for(uint64_t* t = workers[i].trackers; t != NULL; t = (uint64_t*)t[2])
+      t[1] = gc_weak_forward(&gc, t[1]);
+    counters->objects_copied += workers[i].objects_copied;
+    counters->bytes_copied += workers[i].bytes_copied;
+    counters->frames_scanned += workers[i].frames_scanned;
+  }
+  vms->heap_top = (uint64_t*)gc.top;
+
+  free(threads);
+  free(workers);
+  free(gc.queue);
+  pthread_mutex_destroy(&gc.lock);
+  pthread_cond_destroy(&gc.cond);
+  return 1;
+}
+
+//============================================================
+//================= Allocation Sampling ======================
+//============================================================
+
+//Core samples the allocations of natively compiled code, see the
+//Allocation Sampling section in core. The samples are accumulated
+//here, keyed by allocation site and class, so that the report can
+//be printed when the program exits.
+
+typedef struct{
+  void* lbl;
+  char* file;
+  int line;
+  int column;
+} FileInfoEntry;
+
+typedef struct{
+  int64_t length;
+  FileInfoEntry entries[];
+} FileInfoTable;
+
+typedef struct{
+  uint64_t site;
+  int64_t type;
+  int64_t samples;
+  int64_t bytes;
+} AllocSite;
+
+#define NUM_PRINTED_ALLOC_SITES 50
+
+static VMState* alloc_sample_vms;
+static AllocSite* alloc_sites;
+static int64_t alloc_sites_capacity;
+static int64_t num_alloc_sites;
+
+static void print_alloc_profile_at_exit (void);
+
+//Called by core on the allocation slow path until sampling starts.
+//Returns 1 if vms is the state of the heap initialized by main.
+int64_t stz_start_alloc_profile (VMState* vms){
+  if(alloc_sample_vms != NULL || (char*)vms->heap != alloc_sample_heap) return 0;
+  alloc_sample_vms = vms;
+  atexit(print_alloc_profile_at_exit);
+  return 1;
+}
+
+static uint64_t alloc_site_hash (uint64_t site, int64_t type){
+  uint64_t h = (site ^ ((uint64_t)type << 32)) * 0x9E3779B97F4A7C15UL;
+  return h ^ (h >> 29);
+}
+
+static AllocSite* find_alloc_site (uint64_t site, int64_t type){
+  uint64_t mask = alloc_sites_capacity - 1;
+  for(uint64_t i = alloc_site_hash(site, type) & mask; ; i = (i + 1) & mask){
+    AllocSite* e = &alloc_sites[i];
+    if(e->site == 0 || (e->site == site && e->type == type)) return e;
+  }
+}
+
+//Attributes the given number of allocated bytes to the allocation
+//site and class. The table is kept at most half full.
+void stz_record_alloc_sample (uint64_t site, int64_t type, int64_t bytes){
+  if(2 * (num_alloc_sites + 1) > alloc_sites_capacity){
+    AllocSite* old = alloc_sites;
+    int64_t old_capacity = alloc_sites_capacity;
+    alloc_sites_capacity = old_capacity == 0 ? 1024 : 2 * old_capacity;
+    alloc_sites = (AllocSite*)calloc(alloc_sites_capacity, sizeof(AllocSite));
+    for(int64_t i=0; i<old_capacity; i++)
+      if(old[i].site != 0) *find_alloc_site(old[i].site, old[i].type) = old[i];
+    free(old);
+  }
+  AllocSite* e = find_alloc_site(site, type);
+  if(e->site == 0){
+    e->site = site;
+    e->type = type;
+    num_alloc_sites++;
+  }
+  e->samples++;
+  e->bytes += bytes;
+}
+
+static FileInfoEntry* alloc_site_info (uint64_t site){
+  FileInfoTable* table = (FileInfoTable*)alloc_sample_vms->info_table;
+  for(int64_t i=0; i<table->length; i++)
+    if((uint64_t)table->entries[i].lbl == site) return &table->entries[i];
+  return NULL;
+}
+
+static int compare_alloc_bytes (const void* a, const void* b){
+  int64_t x = ((AllocSite*)a)->bytes;
+  int64_t y = ((AllocSite*)b)->bytes;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+//Prints the sites and classes with the most sampled bytes to stderr.
+void stz_print_alloc_profile (){
+  if(alloc_sample_vms == NULL) return;
+  AllocSite* sites = (AllocSite*)malloc((num_alloc_sites + 1) * sizeof(AllocSite));
+  int64_t n = 0;
+  int64_t total = 0;
+  for(int64_t i=0; i<alloc_sites_capacity; i++)
+    if(alloc_sites[i].site != 0){
+      sites[n++] = alloc_sites[i];
+      total += alloc_sites[i].bytes;
+    }
+  qsort(sites, n, sizeof(AllocSite), compare_alloc_bytes);
+  fprintf(stderr, "Allocation profile (~%ld bytes, sampled every %ld bytes):\n",
+          (long)total, (long)stz_alloc_sample_interval);
+  for(int64_t i=0; i<n && i<NUM_PRINTED_ALLOC_SITES; i++){
+    AllocSite* e = &sites[i];
+    FileInfoEntry* info = alloc_site_info(e->site);
+    char* name = alloc_sample_vms->class_table[e->type]->name;
+    int percent = (int)(e->bytes * 100 / total);
+    if(info != NULL)
+      fprintf(stderr, "  %s:%d.%d : %s : %ld bytes (%d%%)\n",
+              info->file, info->line, info->column, name, (long)e->bytes, percent);
+    else
+      fprintf(stderr, "  unknown (%p) : %s : %ld bytes (%d%%)\n",
+              (void*)e->site, name, (long)e->bytes, percent);
+  }
+  fflush(stderr);
+  free(sites);
+}
+
+static void print_alloc_profile_at_exit (void){
+  stz_print_alloc_profile();
+}
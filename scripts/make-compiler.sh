@@ -62,6 +62,7 @@ FILES="core/core.stanza \
        compiler/stz-bindings.stanza \
        compiler/stz-bindings-to-vm.stanza \
        compiler/stz-vm-encoder.stanza \
+       compiler/stz-vm-cache.stanza \
        compiler/stz-trie-table.stanza \
        compiler/stz-hash.stanza \
        compiler/stz-keyed-set.stanza \
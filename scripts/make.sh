@@ -43,9 +43,9 @@ $STANZA build-stanza.proj stz/driver -pkg lpkgs -s lstanza.s -optimize -platform
 
 #Finish on osx
 #gcc -std=gnu99 -c compiler/cvm.c -O3 -o cvm.o
-#gcc -std=gnu99 runtime/driver.c runtime/linenoise.c cvm.o stanza.s -o stanza -DPLATFORM_OS_X -lm
+#gcc -std=gnu99 runtime/driver.c runtime/linenoise.c cvm.o stanza.s -o stanza -DPLATFORM_OS_X -lm -pthread
 #Finish on linux
 #gcc -std=gnu99 -c compiler/cvm.c -O3 -o cvm.o
-#gcc -std=gnu99 runtime/driver.c runtime/linenoise.c cvm.o lstanza.s -o lstanza -DPLATFORM_LINUX -lm -ldl -fPIC
+#gcc -std=gnu99 runtime/driver.c runtime/linenoise.c cvm.o lstanza.s -o lstanza -DPLATFORM_LINUX -lm -pthread -ldl -fPIC
 #Finish on windows
-#gcc -std=gnu99 runtime/driver.c wstanza.s -o wstanza -DPLATFORM_WINDOWS -lm
+#gcc -std=gnu99 runtime/driver.c wstanza.s -o wstanza -DPLATFORM_WINDOWS -lm -pthread
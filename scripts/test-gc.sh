@@ -0,0 +1,17 @@
+./stanza tests/gc-stress.stanza -o build/gc-stress || exit 1
+#Optimized, so that the packages of core are also compiled with the barrier
+./stanza tests/gc-stress.stanza -o build/gc-stress-barrier -optimize -flags GC-WRITE-BARRIER || exit 1
+
+./build/gc-stress || exit 1
+STANZA_NURSERY_SIZE=262144 ./build/gc-stress-barrier || exit 1
+STANZA_GC_THREADS=4 ./build/gc-stress || exit 1
+STANZA_GC_THREADS=4 STANZA_RESERVE_HEAP=1 ./build/gc-stress || exit 1
+STANZA_GC_COMPACT=1 ./build/gc-stress || exit 1
+STANZA_GC_COMPACT=1 ./build/gc-stress-barrier || exit 1
+STANZA_ALLOC_SAMPLE=64k ./build/gc-stress || exit 1
+STANZA_NURSERY_SIZE=262144 STANZA_ALLOC_SAMPLE=64k ./build/gc-stress-barrier || exit 1
+#Live data larger than half of STANZA_MAX_HEAP, and larger than all
+#of it, which only fits once the collector has switched to compacting.
+STANZA_MAX_HEAP=32M ./build/gc-stress 24 || exit 1
+STANZA_MAX_HEAP=32M ./build/gc-stress 48 || exit 1
+STANZA_MAX_HEAP=32M STANZA_NURSERY_SIZE=262144 ./build/gc-stress-barrier 48 || exit 1